@@ -0,0 +1,54 @@
+// access_log.h -- The file format of the binary access log of http_server --access-log.
+//
+// Every thread of the server that sends replies writes its own segment
+// files, PREFIX.TID.N (N = 0, 1, 2, ...): memory mapped files of a fixed
+// size that hold an access_log_header followed by fixed size access_record's,
+// one per reply. When a segment is full the thread continues in the next
+// one. The header is updated after every record, so a segment is valid
+// even if the server was killed; http_accesslog converts the records to
+// CSV or JSON and computes aggregates. All numbers are in host byte order.
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+
+// The first eight bytes of a segment.
+#define ACCESS_LOG_MAGIC "HTTPALOG"
+
+// Incremented on every incompatible change of this file.
+#define ACCESS_LOG_VERSION 1
+
+struct access_log_header
+{
+  char magic[8];			// ACCESS_LOG_MAGIC (without the terminating zero).
+  uint32_t version;			// ACCESS_LOG_VERSION.
+  uint32_t record_size;			// sizeof(struct access_record).
+  uint32_t pid;				// The process and thread that wrote the segment.
+  uint32_t tid;
+  uint32_t segment;			// N.
+  uint32_t reserved;
+  uint64_t start_sec;			// The wall clock time at which the segment was created...
+  uint64_t start_nsec;
+  uint64_t start_ns;			// ...and the same moment on CLOCK_MONOTONIC, to convert the time stamps of the records.
+  uint64_t records;			// The number of records that follow.
+};
+
+// One reply. The time stamps are CLOCK_MONOTONIC nanoseconds.
+struct access_record
+{
+  uint64_t received_ns;			// When the (last byte of the) request was received.
+  uint64_t ready_ns;			// When the reply was complete and not sleeping anymore.
+  uint64_t sent_ns;			// When the reply was released for writing (after the replies before it).
+  uint64_t request;			// X-Request.
+  uint32_t connection;			// X-Connection.
+  uint32_t reply;			// X-Reply.
+  uint32_t bytes;			// The size of the reply.
+  uint32_t sleep_us;			// The requested sleep (X-Sleep, X-Sleep-Us), in microseconds.
+  uint32_t hol_us;			// The head-of-line blocking delay, in microseconds.
+  uint16_t status;			// The HTTP status code.
+  uint16_t reserved;
+  uint64_t reserved2;
+};
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,87 @@
+// example_plugin.c -- An example http_server plugin.
+//
+// Build as a shared object and load it with: ./http_server --plugin ./example_plugin.so
+//
+// It claims two request target keys:
+//
+//   /echo         Replies synchronously with the request target as body.
+//   /async/XXX    Replies from another thread after XXX milliseconds.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "http_server_plugin.h"
+
+static struct http_server_host const* host;
+
+static void complete_text(struct http_server_reply* reply, char const* text, size_t len)
+{
+  char head[128];
+  int head_len = snprintf(head, sizeof head, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: text/plain\r\n", len + 1);
+  char body[600];
+  if (len > sizeof body - 1)
+    len = sizeof body - 1;
+  memcpy(body, text, len);
+  body[len] = '\n';
+  host->complete(reply, head, head_len, body, len + 1);
+}
+
+static int echo(void* user_data, struct http_server_request const* request, struct http_server_reply* reply)
+{
+  (void)user_data;
+  complete_text(reply, request->target, request->target_len);
+  return 0;
+}
+
+struct async_job
+{
+  struct http_server_reply* reply;
+  unsigned long long delay;		// Milliseconds.
+  int connection;
+  int reply_number;
+};
+
+static void* async_thread(void* arg)
+{
+  struct async_job* job = arg;
+  struct timespec ts = { job->delay / 1000, (job->delay % 1000) * 1000000 };
+  nanosleep(&ts, NULL);
+  char text[128];
+  int len = snprintf(text, sizeof text, "Async reply %d on connection %d after %llu ms", job->reply_number, job->connection, job->delay);
+  complete_text(job->reply, text, len);
+  free(job);
+  return NULL;
+}
+
+static int async(void* user_data, struct http_server_request const* request, struct http_server_reply* reply)
+{
+  (void)user_data;
+  struct async_job* job = malloc(sizeof *job);
+  if (!job)
+    return -1;
+  job->reply = reply;
+  job->delay = request->value;
+  job->connection = request->connection;
+  job->reply_number = request->reply;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, async_thread, job) != 0)
+  {
+    free(job);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+int http_server_plugin_init(struct http_server_host const* server)
+{
+  if (server->abi_version != HTTP_SERVER_PLUGIN_ABI_VERSION)
+    return -1;
+  host = server;
+  if (host->claim_path("echo", echo, NULL) != 0 || host->claim_path("async", async, NULL) != 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,189 @@
+// Convert the binary access log of http_server --access-log to CSV or JSON,
+// or compute aggregates over it.
+//
+// Pass any number of segment files (PREFIX.TID.N); the records are printed
+// in the order of the files. The time of a record is the wall clock time at
+// which its request was received; 'ready' and 'latency' are microseconds
+// after that, at which the reply was complete (and done sleeping) and was
+// released for writing, respectively.
+//
+// Compile this as:
+//
+// gcc -std=c11 -O2 -o http_accesslog http_accesslog.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "access_log.h"
+
+enum { format_csv, format_json } format = format_csv;
+int aggregate = 0;			// -a: only print the aggregates.
+
+// The aggregates over all records.
+struct aggregates
+{
+  unsigned long replies;
+  unsigned long long bytes;
+  double first, last;			// The first and last receive time (wall clock seconds).
+  unsigned long status[6];		// Per status class: 1xx ... 5xx; [0] is anything else.
+  unsigned long slept;			// Replies with a requested sleep.
+  unsigned long hol_delayed;		// Replies that were delayed by head-of-line blocking...
+  unsigned long long hol_total;		// ...for this many microseconds in total...
+  unsigned long hol_max;		// ...and at most this long.
+  unsigned long* latency;		// The latency of every reply, in microseconds.
+  size_t latency_size;
+};
+
+struct aggregates agg;
+
+void add_record(struct access_record const* r, double t)
+{
+  unsigned long latency = (r->sent_ns - r->received_ns) / 1000;
+  if (agg.replies == 0 || t < agg.first)
+    agg.first = t;
+  if (agg.replies == 0 || t > agg.last)
+    agg.last = t;
+  if (agg.replies == agg.latency_size)
+  {
+    agg.latency_size = agg.latency_size ? 2 * agg.latency_size : 65536;
+    agg.latency = realloc(agg.latency, agg.latency_size * sizeof(unsigned long));
+  }
+  agg.latency[agg.replies++] = latency;
+  agg.bytes += r->bytes;
+  ++agg.status[r->status >= 100 && r->status < 600 ? r->status / 100 : 0];
+  if (r->sleep_us)
+    ++agg.slept;
+  if (r->hol_us)
+  {
+    ++agg.hol_delayed;
+    agg.hol_total += r->hol_us;
+    if (r->hol_us > agg.hol_max)
+      agg.hol_max = r->hol_us;
+  }
+}
+
+int compare_ulong(void const* a, void const* b)
+{
+  unsigned long x = *(unsigned long const*)a, y = *(unsigned long const*)b;
+  return x < y ? -1 : x > y;
+}
+
+unsigned long percentile(double p)
+{
+  size_t i = (size_t)(p / 100 * agg.replies);
+  return agg.latency[i < agg.replies ? i : agg.replies - 1];
+}
+
+void print_aggregates()
+{
+  if (!agg.replies)
+  {
+    printf("No replies.\n");
+    return;
+  }
+  double span = agg.last - agg.first;
+  qsort(agg.latency, agg.replies, sizeof(unsigned long), compare_ulong);
+  printf("Replies: %lu in %.3f s (%.0f replies/s), %llu bytes\n", agg.replies, span, span > 0 ? agg.replies / span : 0.0, agg.bytes);
+  printf("Status: %lu 2xx, %lu 3xx, %lu 4xx, %lu 5xx, %lu other\n",
+      agg.status[2], agg.status[3], agg.status[4], agg.status[5], agg.status[0] + agg.status[1]);
+  printf("Latency us: p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+      percentile(50), percentile(90), percentile(99), percentile(99.9), agg.latency[agg.replies - 1]);
+  printf("Sleeping: %lu replies\n", agg.slept);
+  printf("HOL: %lu replies delayed, total %llu us, max %lu us\n", agg.hol_delayed, agg.hol_total, agg.hol_max);
+}
+
+// Print (or aggregate) the records of one segment file; return 0 if it isn't a valid segment.
+int read_segment(char const* path)
+{
+  FILE* f = fopen(path, "rb");
+  if (!f)
+  {
+    perror(path);
+    return 0;
+  }
+  struct access_log_header header;
+  if (fread(&header, sizeof header, 1, f) != 1 || memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof header.magic) != 0)
+  {
+    fprintf(stderr, "%s: not an access log segment.\n", path);
+    fclose(f);
+    return 0;
+  }
+  if (header.version != ACCESS_LOG_VERSION || header.record_size != sizeof(struct access_record))
+  {
+    fprintf(stderr, "%s: access log version %u, expected %d.\n", path, header.version, ACCESS_LOG_VERSION);
+    fclose(f);
+    return 0;
+  }
+  for (uint64_t n = 0; n < header.records; ++n)
+  {
+    struct access_record r;
+    if (fread(&r, sizeof r, 1, f) != 1)
+    {
+      fprintf(stderr, "%s: truncated after %lu records.\n", path, (unsigned long)n);
+      break;
+    }
+    // The wall clock time at which the request was received.
+    double t = header.start_sec + header.start_nsec * 1e-9 + ((double)r.received_ns - (double)header.start_ns) * 1e-9;
+    if (aggregate)
+      add_record(&r, t);
+    else if (format == format_csv)
+      printf("%.6f,%u,%u,%lu,%u,%u,%u,%lu,%u,%lu\n", t, r.connection, r.reply, (unsigned long)r.request, r.status, r.bytes,
+	  r.sleep_us, (unsigned long)((r.ready_ns - r.received_ns) / 1000), r.hol_us, (unsigned long)((r.sent_ns - r.received_ns) / 1000));
+    else
+      printf("{\"time\":%.6f,\"connection\":%u,\"reply\":%u,\"request\":%lu,\"status\":%u,\"bytes\":%u,"
+	  "\"sleep_us\":%u,\"ready_us\":%lu,\"hol_us\":%u,\"latency_us\":%lu}\n",
+	  t, r.connection, r.reply, (unsigned long)r.request, r.status, r.bytes,
+	  r.sleep_us, (unsigned long)((r.ready_ns - r.received_ns) / 1000), r.hol_us, (unsigned long)((r.sent_ns - r.received_ns) / 1000));
+  }
+  fclose(f);
+  return 1;
+}
+
+void usage(char const* name)
+{
+  fprintf(stderr, "Usage: %s [-f csv|json] [-a] segment_file...\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "f:a")) != -1)
+    switch (c)
+    {
+      case 'f':
+	if (strcmp(optarg, "csv") == 0)
+	  format = format_csv;
+	else if (strcmp(optarg, "json") == 0)
+	  format = format_json;
+	else
+	{
+	  usage(argv[0]);
+	  return 1;
+	}
+	break;
+      case 'a':
+	aggregate = 1;
+	break;
+      default:
+	usage(argv[0]);
+	return 1;
+    }
+  if (optind == argc)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!aggregate && format == format_csv)
+    printf("time,connection,reply,request,status,bytes,sleep_us,ready_us,hol_us,latency_us\n");
+  int ok = 1;
+  for (int i = optind; i < argc; ++i)
+    ok &= read_segment(argv[i]);
+  if (aggregate)
+    print_aggregates();
+  free(agg.latency);
+  return ok ? 0 : 1;
+}
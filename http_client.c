@@ -2,12 +2,20 @@
 #include <sys/time.h>	// timersub, timercmp
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>	// strncasecmp
 #include <sys/time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <math.h>
+#include <time.h>
 #include <curl/curl.h>
+#include "wire_capture.h"
 
 #ifdef CURL_SUPPORTS_PIPELINING
 
@@ -17,6 +25,142 @@ int const PIPELEN = 4;
 int const NRREQUESTS = 10;
 // Define this to get verbose output.
 int const VERBOSE = 0;
+// The maximum number of different upload sizes that can be passed to -u.
+#define MAXSIZES 16
+
+// Per request (easy handle) state; a pointer to this is stored as CURLOPT_PRIVATE.
+struct request
+{
+  int index;				// The request number (also sent as X-Request).
+  CURL* easy;				// The easy handle of this request.
+  struct curl_slist* headers;		// Custom headers.
+  struct curl_slist* connect_to;	// CURLOPT_CONNECT_TO of the many hosts benchmark.
+  size_t upload_size;			// The size of the request body, or 0 when doing a GET.
+  size_t upload_offset;			// The number of body bytes already passed to libcurl.
+  int was_paused;			// Set once the reply was paused by -P.
+  struct timeval unpause_tv;		// When to unpause this transfer, while paused.
+  struct request* next_paused;		// The next request in the list of paused requests.
+  long x_connection;			// The X-Connection header of the reply, or -1.
+  long x_request;			// The X-Request header of the reply, or -1.
+  long x_reply;				// The X-Reply header of the reply, or -1.
+  int wire_connection;			// The libcurl connection number of this transfer in the wire capture (-w), or -1.
+};
+
+// The initial number of slots of the table in which the reply validator remembers the last X-Reply per connection.
+#define VALIDATE_CONNECTIONS 4096
+
+// Reply validation (CURLOPT_HEADERFUNCTION): ordering, connection reuse and pipeline integrity.
+struct validation_stats
+{
+  long replies;				// Validated replies.
+  long new_connections;			// Replies that were the first one seen on their X-Connection.
+  long missing_headers;			// Replies without X-Connection or X-Reply.
+  long desynchronized;			// Replies whose X-Request is not that of the request (a reply for another request).
+  long out_of_order;			// Replies whose X-Reply doesn't follow the previous one on the same connection.
+  // Open addressing table of X-Connection + 1 (0 is a free slot) -> last X-Reply; doubled when it is 3/4 full.
+  long* connection;
+  long* last_reply;
+  int size;				// The number of slots: VALIDATE_CONNECTIONS, or a multiple of it.
+  int used;				// The number of connections in the table.
+};
+
+// Receive throttling (-r, -P, -S) statistics.
+struct throttle_stats
+{
+  int pauses;				// The number of times that a transfer was paused.
+  double paused_time;			// The sum of the pause durations in seconds.
+  int stalls;				// The number of stall periods that paused at least one transfer.
+};
+
+// The memory-mapped file that request bodies are read from.
+struct upload_source
+{
+  char const* data;
+  size_t size;
+};
+
+// Accumulated upload results for one body size.
+struct upload_stats
+{
+  size_t size;
+  int count;
+  double total_time;			// Sum of CURLINFO_TOTAL_TIME in seconds.
+  double min_time;
+  double max_time;
+  curl_off_t bytes;			// Sum of CURLINFO_SIZE_UPLOAD_T.
+};
+
+// The number of intervals that the resource growth is fitted over in soak mode.
+#define GROWTH_WINDOW 30
+
+// Least squares fit of a resource usage against time over the last GROWTH_WINDOW samples.
+struct growth_tracker
+{
+  double t[GROWTH_WINDOW];
+  double value[GROWTH_WINDOW];
+  int next;
+  int size;
+};
+
+// The cost of the cold start: request #0 plus the probes that pre-warm the connection pool (-W).
+struct cold_start_stats
+{
+  int connections;			// Probes that were answered with a 200 over a new connection.
+  int failed;				// Probes that failed, got another status or reused a connection.
+  double connect_sum;			// Sum of CURLINFO_CONNECT_TIME in seconds.
+  double connect_max;
+  double first_byte_sum;		// Sum of CURLINFO_STARTTRANSFER_TIME in seconds.
+  double first_byte_max;
+};
+
+// Soak mode statistics of the current interval.
+struct soak_stats
+{
+  int completed;			// Successfully finished requests.
+  int failed;				// Requests that timed out or failed otherwise.
+  double* latency;			// CURLINFO_TOTAL_TIME of the completed requests, in seconds.
+  int latency_capacity;
+  struct growth_tracker rss;
+  struct growth_tracker fds;
+};
+
+char url[256];
+char const* upload_method = NULL;	// "POST" or "PUT" when uploading, NULL otherwise.
+struct upload_source upload_source;
+struct upload_stats upload_stats[MAXSIZES];
+int nr_upload_sizes = 0;
+int soak = 0;				// Set when running in soak mode (-s).
+int soak_interval = 10;			// Seconds between soak reports (-i).
+int soak_sleep = 100;			// X-Sleep of the requests in soak mode (-d).
+int fastopen = 0;			// Use TCP Fast Open (-F).
+curl_off_t max_recv_speed = 0;		// The maximum receive speed in bytes per second (-r), or 0.
+int pause_ms = 0;			// Pause every reply this many milliseconds when its body starts to arrive (-P).
+int stall_ms = 0;			// Stop reading all connections for this many milliseconds (-S) ...
+int stall_period_ms = 1000;		// ... every this many milliseconds.
+struct request* paused_requests;	// The requests that are currently paused.
+struct throttle_stats throttle_stats;
+struct soak_stats soak_stats;
+int pool_size = 1;			// The number of connections to open and validate before the measured phase (-W).
+long keepalive_s = 0;			// TCP keep-alive probe interval of the connections in seconds (-W count/seconds), or 0.
+struct cold_start_stats cold_start_stats;
+struct validation_stats validation_stats;
+
+// The wire capture (-w); see wire_capture.h.
+struct wire_capture
+{
+  char const* filename;			// The capture file.
+  char* buffer;				// The preallocated capture buffer, or NULL when not capturing.
+  size_t size;				// The size of buffer.
+  size_t used;				// The number of bytes of buffer that are in use.
+  uint64_t records;			// The number of records in buffer.
+  uint64_t dropped;			// The number of events that didn't fit in buffer anymore.
+  struct timespec start;		// Time 0 of the capture (CLOCK_MONOTONIC).
+  struct timespec start_realtime;	// Time 0 of the capture (CLOCK_REALTIME).
+  int connections;			// The largest connection ID seen plus one.
+  int connection;			// The connection of a handle without request (the reconnect benchmark).
+};
+
+struct wire_capture wire_capture;
 
 void print_time_prefix()
 {
@@ -51,16 +195,775 @@ void print_time_prefix()
   last_tv = tv;
 }
 
-void add_next_handle(CURLM* multi_handle, CURL* handles[], int* added, int* running)
+// Parse a size with an optional k, m or g suffix (powers of 1024).
+size_t parse_size(char const* str, char** endptr)
 {
-  curl_multi_add_handle(multi_handle, handles[*added]);
-  ++*running;
+  size_t size = strtoul(str, endptr, 10);
+  switch (**endptr)
+  {
+    case 'g': case 'G':
+      size *= 1024;
+      // fall-through
+    case 'm': case 'M':
+      size *= 1024;
+      // fall-through
+    case 'k': case 'K':
+      size *= 1024;
+      ++*endptr;
+  }
+  return size;
+}
+
+// Parse the comma separated list of sizes passed to -u.
+int parse_upload_sizes(char const* arg)
+{
+  char* end;
+  for (char const* p = arg; *p; p = end + 1)
+  {
+    if (nr_upload_sizes == MAXSIZES)
+    {
+      fprintf(stderr, "Too many upload sizes (max %d).\n", MAXSIZES);
+      return 0;
+    }
+    size_t size = parse_size(p, &end);
+    if (end == p || (*end != ',' && *end != 0) || size == 0)
+    {
+      fprintf(stderr, "Invalid upload size list '%s'.\n", arg);
+      return 0;
+    }
+    upload_stats[nr_upload_sizes++].size = size;
+    if (*end == 0)
+      break;
+  }
+  return 1;
+}
+
+// Map 'filename' into memory, or - when filename is NULL - create an unlinked
+// temporary file of 'size' bytes filled with a pattern and map that.
+int map_upload_source(char const* filename, size_t size)
+{
+  int fd;
+  if (filename)
+  {
+    struct stat st;
+    if ((fd = open(filename, O_RDONLY)) == -1)
+    {
+      perror(filename);
+      return 0;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+      perror(filename);
+      close(fd);
+      return 0;
+    }
+    if ((size_t)st.st_size < size)
+    {
+      fprintf(stderr, "%s is smaller than the largest upload size (%zu bytes).\n", filename, size);
+      close(fd);
+      return 0;
+    }
+    size = st.st_size;
+  }
+  else
+  {
+    char const* tmpdir = getenv("TMPDIR");
+    char path[256];
+    snprintf(path, sizeof path, "%s/http_client_upload.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    if ((fd = mkstemp(path)) == -1)
+    {
+      perror(path);
+      return 0;
+    }
+    if (unlink(path) == -1 || ftruncate(fd, size) == -1)
+    {
+      perror(path);
+      close(fd);
+      return 0;
+    }
+    // Fill the file through a temporary writable mapping.
+    char* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+      perror("mmap");
+      close(fd);
+      return 0;
+    }
+    for (size_t i = 0; i < size; ++i)
+      p[i] = 'a' + i % 26;
+    munmap(p, size);
+  }
+  void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    perror("mmap");
+    return 0;
+  }
+  // The body is read sequentially, once per request.
+  madvise(data, size, MADV_SEQUENTIAL);
+  upload_source.data = data;
+  upload_source.size = size;
+  return 1;
+}
+
+// CURLOPT_READFUNCTION: copy the next part of the body straight from the mapped file into libcurl's upload buffer.
+size_t read_callback(char* buffer, size_t size, size_t nitems, void* userp)
+{
+  struct request* req = userp;
+  size_t len = req->upload_size - req->upload_offset;
+  if (len > size * nitems)
+    len = size * nitems;
+  memcpy(buffer, upload_source.data + req->upload_offset, len);
+  req->upload_offset += len;
+  return len;
+}
+
+// CURLOPT_SEEKFUNCTION: libcurl needs to rewind the body when it resends a request on a new connection.
+int seek_callback(void* userp, curl_off_t offset, int origin)
+{
+  struct request* req = userp;
+  if (origin != SEEK_SET || offset < 0 || (size_t)offset > req->upload_size)
+    return CURL_SEEKFUNC_FAIL;
+  req->upload_offset = offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+// Return the resident set size of this process in kB.
+long resident_set_size()
+{
+  long size, resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm)
+  {
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+      resident = 0;
+    fclose(statm);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Return the number of open file descriptors of this process.
+int open_fds()
+{
+  int count = 0;
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir)
+  {
+    struct dirent* entry;
+    while ((entry = readdir(dir)))
+      if (entry->d_name[0] != '.')
+	++count;
+    closedir(dir);
+    --count;		// The descriptor of dir itself.
+  }
+  return count;
+}
+
+void growth_add(struct growth_tracker* tracker, double t, double value)
+{
+  tracker->t[tracker->next] = t;
+  tracker->value[tracker->next] = value;
+  tracker->next = (tracker->next + 1) % GROWTH_WINDOW;
+  if (tracker->size < GROWTH_WINDOW)
+    ++tracker->size;
+}
+
+// Return the slope of the fit in units per hour, and the coefficient of determination in *r2.
+double growth_slope_per_hour(struct growth_tracker const* tracker, double* r2)
+{
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+  for (int i = 0; i < tracker->size; ++i)
+  {
+    double x = tracker->t[i], y = tracker->value[i];
+    sx += x; sy += y; sxx += x * x; sxy += x * y; syy += y * y;
+  }
+  double n = tracker->size;
+  double vx = n * sxx - sx * sx;
+  double vy = n * syy - sy * sy;
+  double cov = n * sxy - sx * sy;
+  *r2 = (vx > 0 && vy > 0) ? cov * cov / (vx * vy) : 0.0;
+  return vx > 0 ? 3600.0 * cov / vx : 0.0;
+}
+
+// Warn when a resource grows steadily; a large slope alone can be caused by a burst of activity.
+void growth_check(char const* what, struct growth_tracker const* tracker, double threshold, char const* unit)
+{
+  double r2;
+  double slope = growth_slope_per_hour(tracker, &r2);
+  if (tracker->size >= 10 && slope > threshold && r2 > 0.9)
+    printf("WARNING: %s grows by %.1f%s per hour (r^2 = %.2f); possible leak.\n", what, slope, unit, r2);
+}
+
+int compare_double(void const* a, void const* b)
+{
+  double x = *(double const*)a, y = *(double const*)b;
+  return (x > y) - (x < y);
+}
+
+void soak_add_latency(double latency)
+{
+  struct soak_stats* ss = &soak_stats;
+  if (ss->completed == ss->latency_capacity)
+  {
+    ss->latency_capacity = ss->latency_capacity ? 2 * ss->latency_capacity : 1024;
+    ss->latency = realloc(ss->latency, ss->latency_capacity * sizeof(double));
+  }
+  ss->latency[ss->completed++] = latency;
+}
+
+// Return the pct percentile of the n sorted values.
+double percentile(double const* sorted, int n, double pct)
+{
+  if (n == 0)
+    return 0.0;
+  int i = (int)ceil(pct / 100.0 * n) - 1;
+  return sorted[i < 0 ? 0 : i];
+}
+
+// Return the number of milliseconds since the first call.
+long elapsed_ms()
+{
+  static struct timeval start_tv;
+  struct timeval now_tv, diff_tv;
+  gettimeofday(&now_tv, NULL);
+  if (!start_tv.tv_sec)
+    start_tv = now_tv;
+  timersub(&now_tv, &start_tv, &diff_tv);
+  return diff_tv.tv_sec * 1000 + diff_tv.tv_usec / 1000;
+}
+
+// Pause the transfer of req for ms milliseconds; this stops libcurl from reading its connection.
+size_t pause_request(struct request* req, long ms)
+{
+  struct timeval now_tv, pause_tv = { ms / 1000, (ms % 1000) * 1000 };
+  gettimeofday(&now_tv, NULL);
+  timeradd(&now_tv, &pause_tv, &req->unpause_tv);
+  req->next_paused = paused_requests;
+  paused_requests = req;
+  ++throttle_stats.pauses;
+  throttle_stats.paused_time += ms * 1e-3;
+  return CURL_WRITEFUNC_PAUSE;
+}
+
+// Remove req from the list of paused requests, if it is there.
+void unlink_paused(struct request* req)
+{
+  for (struct request** p = &paused_requests; *p; p = &(*p)->next_paused)
+    if (*p == req)
+    {
+      *p = req->next_paused;
+      break;
+    }
+}
+
+// Continue the paused transfers whose pause is over. Return the number of milliseconds until
+// the next pause is over, or -1 if nothing is paused anymore.
+long unpause_expired()
+{
+  struct timeval now_tv;
+  gettimeofday(&now_tv, NULL);
+  // Unpausing can call the write callback, which might pause the transfer again; so detach the list first.
+  struct request* list = paused_requests;
+  paused_requests = NULL;
+  while (list)
+  {
+    struct request* req = list;
+    list = req->next_paused;
+    if (timercmp(&now_tv, &req->unpause_tv, <))
+    {
+      req->next_paused = paused_requests;
+      paused_requests = req;
+    }
+    else
+      curl_easy_pause(req->easy, CURLPAUSE_CONT);
+  }
+  long next = -1;
+  for (struct request* req = paused_requests; req; req = req->next_paused)
+  {
+    struct timeval diff_tv;
+    timersub(&req->unpause_tv, &now_tv, &diff_tv);
+    long ms = diff_tv.tv_sec * 1000 + diff_tv.tv_usec / 1000 + 1;
+    if (next == -1 || ms < next)
+      next = ms;
+  }
+  return next;
+}
+
+// CURLOPT_WRITEFUNCTION used with -P or -S: pause the transfer when its reply (body) starts to
+// arrive, or when data arrives during a stall period. Otherwise print or discard the data like usual.
+size_t throttle_write_callback(char* ptr, size_t size, size_t nmemb, void* userp)
+{
+  struct request* req = userp;
+  if (stall_ms)
+  {
+    static long last_stall = -1;
+    long now = elapsed_ms();
+    long in_period = now % stall_period_ms;
+    if (in_period < stall_ms)
+    {
+      if (now / stall_period_ms != last_stall)
+      {
+	last_stall = now / stall_period_ms;
+	++throttle_stats.stalls;
+      }
+      return pause_request(req, stall_ms - in_period);
+    }
+  }
+  if (pause_ms && !req->was_paused)
+  {
+    req->was_paused = 1;
+    return pause_request(req, pause_ms);
+  }
+  if (soak)
+    return size * nmemb;
+  return fwrite(ptr, size, nmemb, stdout);
+}
+
+// Print the throttling statistics of the whole run.
+void print_throttle_stats()
+{
+  if (!max_recv_speed && !pause_ms && !stall_ms)
+    return;
+  printf("Throttling: max receive speed %" CURL_FORMAT_CURL_OFF_T " bytes/s, %d pauses (%.3f s in total), %d stalls of %d ms.\n",
+      max_recv_speed, throttle_stats.pauses, throttle_stats.paused_time, throttle_stats.stalls, stall_ms);
+}
+
+// If the header line [line, line + len) is 'name: digits', store the number in *value and return 1.
+int parse_number_header(char const* line, size_t len, char const* name, long* value)
+{
+  size_t name_len = strlen(name);
+  if (len < name_len + 2 || strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+    return 0;
+  char const* p = line + name_len + 1;
+  char const* end = line + len;
+  while (p < end && *p == ' ')
+    ++p;
+  if (p == end || !isdigit((unsigned char)*p))
+    return 0;
+  long n = 0;
+  while (p < end && isdigit((unsigned char)*p))
+    n = 10 * n + (*p++ - '0');
+  *value = n;
+  return 1;
+}
+
+// CURLOPT_HEADERFUNCTION: pick up X-Connection, X-Request and X-Reply. The line is not NUL terminated.
+size_t header_callback(char* buffer, size_t size, size_t nitems, void* userp)
+{
+  struct request* req = userp;
+  size_t len = size * nitems;
+  if (len > 2 && (buffer[0] == 'X' || buffer[0] == 'x'))
+  {
+    if (!parse_number_header(buffer, len, "X-Connection", &req->x_connection) &&
+	!parse_number_header(buffer, len, "X-Request", &req->x_request))
+      parse_number_header(buffer, len, "X-Reply", &req->x_reply);
+  }
+  return len;
+}
+
+// Print a hard validation failure (only the first few).
+void validation_failure(struct request const* req, char const* what)
+{
+  struct validation_stats const* vs = &validation_stats;
+  if (vs->missing_headers + vs->desynchronized + vs->out_of_order > 10)
+    return;
+  printf("VALIDATION FAILED: %s: request #%d got X-Connection %ld, X-Request %ld, X-Reply %ld.\n",
+      what, req->index, req->x_connection, req->x_request, req->x_reply);
+}
+
+// Return the slot of X-Connection connection in the validation table, or the free slot where it belongs.
+int validation_slot(struct validation_stats const* vs, long connection)
+{
+  int slot = connection % vs->size;
+  while (vs->connection[slot] != 0 && vs->connection[slot] != connection + 1)
+    slot = (slot + 1) % vs->size;
+  return slot;
+}
+
+// Allocate the validation table, or double its size.
+void validation_grow(struct validation_stats* vs)
+{
+  long* old_connection = vs->connection;
+  long* old_last_reply = vs->last_reply;
+  int old_size = vs->size;
+  vs->size = old_size ? 2 * old_size : VALIDATE_CONNECTIONS;
+  vs->connection = calloc(vs->size, sizeof(long));
+  vs->last_reply = calloc(vs->size, sizeof(long));
+  if (!vs->connection || !vs->last_reply)
+  {
+    fprintf(stderr, "Out of memory for the reply validation.\n");
+    exit(1);
+  }
+  for (int i = 0; i < old_size; ++i)
+    if (old_connection[i])
+    {
+      int slot = validation_slot(vs, old_connection[i] - 1);
+      vs->connection[slot] = old_connection[i];
+      vs->last_reply[slot] = old_last_reply[i];
+    }
+  free(old_connection);
+  free(old_last_reply);
+}
+
+// Check the reply of req, which finished successfully. Replies on the same connection arrive in
+// pipeline order, so X-Reply must count up by one per connection, and X-Request must be ours.
+void validate_reply(struct request const* req)
+{
+  struct validation_stats* vs = &validation_stats;
+  ++vs->replies;
+  if (req->x_connection < 0 || req->x_reply < 0)
+  {
+    ++vs->missing_headers;
+    validation_failure(req, "missing headers");
+    return;
+  }
+  // Pool probes (negative index) don't send an X-Request.
+  if (req->index >= 0 && req->x_request != req->index)
+  {
+    ++vs->desynchronized;
+    validation_failure(req, "pipeline desynchronized");
+  }
+  if (4 * (vs->used + 1) > 3 * vs->size)
+    validation_grow(vs);
+  int slot = validation_slot(vs, req->x_connection);
+  if (vs->connection[slot] == 0)
+  {
+    // The first reply on this connection.
+    vs->connection[slot] = req->x_connection + 1;
+    vs->last_reply[slot] = req->x_reply;
+    ++vs->used;
+    ++vs->new_connections;
+    return;
+  }
+  if (req->x_reply != vs->last_reply[slot] + 1)
+  {
+    ++vs->out_of_order;
+    validation_failure(req, "reply out of order");
+  }
+  vs->last_reply[slot] = req->x_reply;
+}
+
+// Print the validation statistics; return the number of hard failures.
+long print_validation()
+{
+  struct validation_stats const* vs = &validation_stats;
+  long failures = vs->missing_headers + vs->desynchronized + vs->out_of_order;
+  if (!vs->replies)
+    return 0;
+  printf("Validation: %ld replies over %ld connections (reuse ratio %.2f%%); %ld out of order, %ld desynchronized, %ld without headers%s\n",
+      vs->replies, vs->new_connections, 100.0 * (vs->replies - vs->new_connections) / vs->replies,
+      vs->out_of_order, vs->desynchronized, vs->missing_headers, failures ? " -- FAILED." : ".");
+  return failures;
+}
+
+// Write the capture buffer to the capture file; called at exit.
+void wire_capture_flush()
+{
+  struct wire_capture const* wc = &wire_capture;
+  struct wire_capture_header header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, WIRE_CAPTURE_MAGIC, sizeof header.magic);
+  header.version = WIRE_CAPTURE_VERSION;
+  header.connections = wc->connections;
+  header.start_sec = wc->start_realtime.tv_sec;
+  header.start_nsec = wc->start_realtime.tv_nsec;
+  header.records = wc->records;
+  header.dropped = wc->dropped;
+  FILE* f = fopen(wc->filename, "wb");
+  if (!f || fwrite(&header, sizeof header, 1, f) != 1 || fwrite(wc->buffer, 1, wc->used, f) != wc->used || fclose(f) != 0)
+  {
+    perror(wc->filename);
+    return;
+  }
+  printf("Wire capture: %lu events over %d connections (%zu bytes) written to %s",
+      (unsigned long)wc->records, wc->connections, wc->used, wc->filename);
+  if (wc->dropped)
+    printf("; %lu events DROPPED because the buffer was full.\n", (unsigned long)wc->dropped);
+  else
+    printf(".\n");
+}
+
+// Allocate a capture buffer of size bytes and fault it in, so that capturing doesn't cause page faults
+// or allocations during the run. The capture is written to filename when the client exits.
+int wire_capture_start(char const* filename, size_t size)
+{
+  struct wire_capture* wc = &wire_capture;
+  void* buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (buffer == MAP_FAILED)
+  {
+    perror("mmap");
+    return 0;
+  }
+  wc->filename = filename;
+  wc->buffer = buffer;
+  wc->size = size;
+  clock_gettime(CLOCK_MONOTONIC, &wc->start);
+  clock_gettime(CLOCK_REALTIME, &wc->start_realtime);
+  atexit(wire_capture_flush);
+  return 1;
+}
+
+// CURLOPT_DEBUGFUNCTION: append a record for every header and data event to the capture buffer.
+int wire_debug_callback(CURL* easy, curl_infotype type, char* data, size_t size, void* userp)
+{
+  struct request* req = userp;
+  struct wire_capture* wc = &wire_capture;
+  int* connection = req ? &req->wire_connection : &wc->connection;
+  if (type == CURLINFO_TEXT)
+  {
+    if (VERBOSE)
+      printf("* %.*s", (int)size, data);
+    // libcurl doesn't tell which connection a transfer uses while it runs (CURLINFO_ACTIVESOCKET only
+    // works after it finished), but it does mention its connection number in the "Connected to ... (#N)"
+    // and "Re-using existing connection #N" messages.
+    char const* hash = memchr(data, '#', size);
+    if (hash && hash + 1 < data + size && isdigit((unsigned char)hash[1]))
+    {
+      *connection = atoi(hash + 1);
+      if (*connection >= wc->connections)
+	wc->connections = *connection + 1;
+    }
+    return 0;
+  }
+  // The wire_type values are those of curl_infotype; the TLS data isn't captured.
+  if (type < CURLINFO_HEADER_IN || type > CURLINFO_DATA_OUT)
+    return 0;
+  size_t record_size = WIRE_RECORD_SIZE(size);
+  if (wc->used + record_size > wc->size)
+  {
+    ++wc->dropped;
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  struct wire_record* record = (struct wire_record*)(wc->buffer + wc->used);
+  record->time_ns = (uint64_t)(now.tv_sec - wc->start.tv_sec) * 1000000000 + now.tv_nsec - wc->start.tv_nsec;
+  record->connection = *connection;
+  record->request = req ? req->index : -1;
+  record->type = type;
+  record->length = size;
+  memcpy(record + 1, data, size);	// The padding is still zero from mmap.
+  wc->used += record_size;
+  ++wc->records;
+  return 0;
+}
+
+// Capture the traffic of easy (req may be NULL), if -w was given.
+void wire_capture_setopt(CURL* easy, struct request* req)
+{
+  if (!wire_capture.buffer)
+    return;
+  curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
+  curl_easy_setopt(easy, CURLOPT_DEBUGFUNCTION, wire_debug_callback);
+  curl_easy_setopt(easy, CURLOPT_DEBUGDATA, req);
+  if (req)
+    req->wire_connection = -1;
+  else
+    wire_capture.connection = -1;
+}
+
+// Print the statistics of the last interval and reset them.
+void soak_report(double t, double elapsed, int running)
+{
+  struct soak_stats* ss = &soak_stats;
+  long rss = resident_set_size();
+  int fds = open_fds();
+  growth_add(&ss->rss, t, rss);
+  growth_add(&ss->fds, t, fds);
+  qsort(ss->latency, ss->completed, sizeof(double), compare_double);
+  double r2;
   print_time_prefix();
-  printf("Request #%d    added [now running: %d]\n", *added, *running);
+  printf("SOAK t=%.0fs: %.1f req/s, %d failed; latency ms p50 %.3f p90 %.3f p99 %.3f max %.3f; "
+      "RSS %ld kB (%+.1f kB/h), fds %d (%+.1f/h), running %d\n",
+      t, ss->completed / elapsed, ss->failed,
+      1000.0 * percentile(ss->latency, ss->completed, 50), 1000.0 * percentile(ss->latency, ss->completed, 90),
+      1000.0 * percentile(ss->latency, ss->completed, 99), 1000.0 * percentile(ss->latency, ss->completed, 100),
+      rss, growth_slope_per_hour(&ss->rss, &r2), fds, growth_slope_per_hour(&ss->fds, &r2), running);
+  print_throttle_stats();
+  print_validation();
+  growth_check("RSS", &ss->rss, 1024.0, " kB");
+  growth_check("Number of open fds", &ss->fds, 10.0, "");
+  fflush(stdout);
+  ss->completed = ss->failed = 0;
+}
+
+// CURLOPT_WRITEFUNCTION used in soak mode: throw the reply body away instead of printing it.
+size_t discard_callback(char* ptr, size_t size, size_t nmemb, void* userp)
+{
+  return size * nmemb;
+}
+
+// Create the easy handle for request number i.
+struct request* create_request(int i)
+{
+  char header_buf[256];
+  struct request* req = calloc(1, sizeof(struct request));
+  CURL* easy = req->easy = curl_easy_init();
+  req->index = i;
+  req->x_connection = req->x_request = req->x_reply = -1;
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, req);
+  curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(easy, CURLOPT_HEADERDATA, req);
+  curl_easy_setopt(easy, CURLOPT_STDERR, stdout);
+  curl_easy_setopt(easy, CURLOPT_VERBOSE, VERBOSE ? 1L : 0L);
+  wire_capture_setopt(easy, req);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT, (i == 3 && !soak) ? 10L : 1L);				// Timeout after 1 seconds.
+  curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt(easy, CURLOPT_URL, url);
+  if (fastopen)
+    curl_easy_setopt(easy, CURLOPT_TCP_FASTOPEN, 1L);
+  if (keepalive_s)
+  {
+    // Keep idle pooled connections warm with TCP keep-alive probes; unlike a request, those don't end up in a pipeline.
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPIDLE, keepalive_s);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPINTVL, keepalive_s);
+  }
+  if (soak || i < 0)
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_callback);
+  if (pause_ms || stall_ms)
+  {
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, throttle_write_callback);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, req);
+  }
+  if (max_recv_speed)
+    curl_easy_setopt(easy, CURLOPT_MAX_RECV_SPEED_LARGE, max_recv_speed);
+  if (upload_method && i >= 0)
+  {
+    // Cycle through the upload sizes; the body is fed from the mapped file by read_callback.
+    req->upload_size = upload_stats[i % nr_upload_sizes].size;
+    curl_easy_setopt(easy, CURLOPT_READFUNCTION, read_callback);
+    curl_easy_setopt(easy, CURLOPT_READDATA, req);
+    curl_easy_setopt(easy, CURLOPT_SEEKFUNCTION, seek_callback);
+    curl_easy_setopt(easy, CURLOPT_SEEKDATA, req);
+    if (upload_method[1] == 'O')	// POST
+    {
+      curl_easy_setopt(easy, CURLOPT_POST, 1L);
+      curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req->upload_size);
+    }
+    else				// PUT
+    {
+      curl_easy_setopt(easy, CURLOPT_UPLOAD, 1L);
+      curl_easy_setopt(easy, CURLOPT_INFILESIZE_LARGE, (curl_off_t)req->upload_size);
+    }
+    // Don't wait for a "100 Continue" that the server never sends; and don't let libcurl think this is form data.
+    req->headers = curl_slist_append(req->headers, "Expect:");
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/octet-stream");
+  }
+  else
+    curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+  // Construct the headers.
+  if (soak)
+    snprintf(header_buf, sizeof header_buf, "X-Sleep: %d", soak_sleep);		// All requests are the same in soak mode.
+  else
+    snprintf(header_buf, sizeof header_buf, "X-Sleep: %d", (i != 1) ? 100 : 1100);	// Server delays reply 0.1 seconds except for request #1, which will be 1.1 seconds delayed.
+  // No delay for the first one, which is just to establish that the server supports http pipelining.
+  // Neither when uploading, so that the measured latency is that of the upload itself.
+  if (i > 0 && !upload_method)
+    req->headers = curl_slist_append(req->headers, header_buf);
+  snprintf(header_buf, sizeof header_buf, "X-Request: %d", i);			// The requests are numbered 0 through NRREQUESTS - 1.
+  if (i >= 0)									// Pool probes (-W) have a negative index.
+    req->headers = curl_slist_append(req->headers, header_buf);
+  if (i == 7 && !soak)
+  {
+    snprintf(header_buf, sizeof header_buf, "X-Disconnect: yes");
+    req->headers = curl_slist_append(req->headers, header_buf);
+  }
+  curl_easy_setopt(easy, CURLOPT_HTTPHEADER, req->headers);
+  return req;
+}
+
+// Return true when there are more requests to be added.
+int more_requests(int added)
+{
+  return soak || added < NRREQUESTS;
+}
+
+void add_next_handle(CURLM* multi_handle, int* added, int* running)
+{
+  struct request* req = create_request(*added);
+  curl_multi_add_handle(multi_handle, req->easy);
+  ++*running;
+  if (!soak)
+  {
+    print_time_prefix();
+    printf("Request #%d    added [now running: %d]\n", *added, *running);
+  }
   ++*added;
 }
 
-void process_results(CURLM* multi_handle, CURL* handles[], struct curl_slist* headers[], int* running)
+// Add the upload results of a successfully finished request to the statistics of its body size.
+void update_upload_stats(struct request* req)
+{
+  double total_time;
+  curl_off_t bytes;
+  curl_easy_getinfo(req->easy, CURLINFO_TOTAL_TIME, &total_time);
+  curl_easy_getinfo(req->easy, CURLINFO_SIZE_UPLOAD_T, &bytes);
+  for (int i = 0; i < nr_upload_sizes; ++i)
+  {
+    struct upload_stats* us = &upload_stats[i];
+    if (us->size != req->upload_size)
+      continue;
+    if (us->count == 0 || total_time < us->min_time)
+      us->min_time = total_time;
+    if (total_time > us->max_time)
+      us->max_time = total_time;
+    ++us->count;
+    us->total_time += total_time;
+    us->bytes += bytes;
+    break;
+  }
+}
+
+void print_upload_stats(double elapsed)
+{
+  curl_off_t total_bytes = 0;
+  printf("\nUpload results (%s):\n", upload_method);
+  printf("%12s %6s %10s %10s %10s %10s\n", "body size", "count", "avg ms", "min ms", "max ms", "MB/s");
+  for (int i = 0; i < nr_upload_sizes; ++i)
+  {
+    struct upload_stats* us = &upload_stats[i];
+    if (us->count == 0)
+    {
+      printf("%12zu %6d %10s %10s %10s %10s\n", us->size, 0, "-", "-", "-", "-");
+      continue;
+    }
+    // The per size throughput is that of the individual requests; they overlap in time when pipelined.
+    printf("%12zu %6d %10.3f %10.3f %10.3f %10.2f\n", us->size, us->count,
+	1000.0 * us->total_time / us->count, 1000.0 * us->min_time, 1000.0 * us->max_time,
+	us->total_time > 0 ? us->bytes / us->total_time / (1024 * 1024) : 0.0);
+    total_bytes += us->bytes;
+  }
+  printf("Uploaded %" CURL_FORMAT_CURL_OFF_T " bytes in %.3f seconds: %.2f MB/s.\n",
+      total_bytes, elapsed, elapsed > 0 ? total_bytes / elapsed / (1024 * 1024) : 0.0);
+}
+
+// Add request #0 or pool probe 'easy', that finished successfully, to the cold start statistics.
+void add_cold_start(CURL* easy)
+{
+  struct cold_start_stats* cs = &cold_start_stats;
+  long code, connects;
+  double connect, first_byte;
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+  curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+  curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME, &connect);
+  curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+  if (code != 200 || connects != 1)
+  {
+    ++cs->failed;
+    return;
+  }
+  ++cs->connections;
+  cs->connect_sum += connect;
+  cs->first_byte_sum += first_byte;
+  if (connect > cs->connect_max)
+    cs->connect_max = connect;
+  if (first_byte > cs->first_byte_max)
+    cs->first_byte_max = first_byte;
+}
+
+void process_results(CURLM* multi_handle, int* running)
 {
   CURLMsg* msg;
   int msgs_left;
@@ -69,40 +972,71 @@ void process_results(CURLM* multi_handle, CURL* handles[], struct curl_slist* he
     if (msg->msg == CURLMSG_DONE)
     {
       CURL* easy = msg->easy_handle;
-      // Find out which handle this message is about.
-      int found = -1;
-      for (int i = 0; i < NRREQUESTS; ++i)
-      {
-	if (easy == handles[i])
-	{
-	  found = i;
-	  break;
-	}
-      }
-      if (found >= 0)
+      // Find out which request this message is about.
+      struct request* req = NULL;
+      curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char**)&req);
+      if (req)
       {
-	print_time_prefix();
-	if (msg->data.result == 28)
+	int found = req->index;
+	--*running;
+	if (msg->data.result == 0)
+	  validate_reply(req);
+	// Request #0 and the pool probes are not part of the measured phase.
+	if (found < 0)
 	{
-	  printf("Request    #%d TIMED OUT!", found);
+	  if (msg->data.result == 0)
+	    add_cold_start(easy);
+	  else
+	    ++cold_start_stats.failed;
 	}
-	else if (msg->data.result == 0)
+	else if (msg->data.result != 0)
+	  ++soak_stats.failed;
+	else if (found == 0)
+	  add_cold_start(easy);
+	else
 	{
-	  printf("Request    #%d finished", found);
+	  if (req->upload_size)
+	    update_upload_stats(req);
+	  if (soak)
+	  {
+	    double total_time;
+	    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &total_time);
+	    soak_add_latency(total_time);
+	  }
 	}
-	else
+	// In soak mode only failures are printed, and pool probes only when they fail.
+	if ((!soak && found >= 0) || msg->data.result != 0)
 	{
-	  printf("Request    #%d completed with status %d", found, msg->data.result);
-	  if (msg->data.result == 7)
+	  print_time_prefix();
+	  if (msg->data.result == 28)
+	  {
+	    printf("Request    #%d TIMED OUT!", found);
+	  }
+	  else if (msg->data.result == 0)
 	  {
-	    printf("\n\nERROR: connection refused. Are you sure the server is running?\n");
-	    exit(1);
+	    printf("Request    #%d finished", found);
+	    long connects;
+	    double starttransfer;
+	    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+	    curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+	    if (connects > 0 && found > 0)
+	      printf(" (new connection, first byte after %.3f ms)", 1000.0 * starttransfer);
 	  }
+	  else
+	  {
+	    printf("Request    #%d completed with status %d", found, msg->data.result);
+	    if (msg->data.result == 7)
+	    {
+	      printf("\n\nERROR: connection refused. Are you sure the server is running?\n");
+	      exit(1);
+	    }
+	  }
+	  printf(" [now running: %d]\n", *running);
 	}
 	// Clean up the headers.
-	curl_slist_free_all(headers[found]);
-	--*running;
-	printf(" [now running: %d]\n", *running);
+	curl_slist_free_all(req->headers);
+	unlink_paused(req);
+	free(req);
       }
       else
       {
@@ -113,13 +1047,354 @@ void process_results(CURLM* multi_handle, CURL* handles[], struct curl_slist* he
   }
 }
 
+// Open pool_size - 1 more connections next to the one of request #0, by sending a probe over a
+// fresh connection each, all at the same time, and wait until they finished.
+void warm_pool(CURLM* multi_handle)
+{
+  int running = 0;
+  curl_multi_setopt(multi_handle, CURLMOPT_MAXCONNECTS, (long)pool_size);
+  for (int i = 1; i < pool_size; ++i)
+  {
+    struct request* req = create_request(-i);
+    curl_easy_setopt(req->easy, CURLOPT_FRESH_CONNECT, 1L);
+    curl_multi_add_handle(multi_handle, req->easy);
+    ++running;
+  }
+  int still_running;
+  do
+  {
+    curl_multi_perform(multi_handle, &still_running);
+    process_results(multi_handle, &running);
+    if (still_running)
+      curl_multi_wait(multi_handle, NULL, 0, 100, NULL);
+  }
+  while (still_running);
+  process_results(multi_handle, &running);
+}
+
+// Print the cold start cost, that took 'elapsed' seconds of wall clock time.
+void print_cold_start(double elapsed)
+{
+  struct cold_start_stats const* cs = &cold_start_stats;
+  int n = cs->connections ? cs->connections : 1;
+  printf("Cold start: %d of %d connections ready after %.3f ms; connect avg %.3f ms max %.3f ms, first byte avg %.3f ms max %.3f ms",
+      cs->connections, pool_size, 1000.0 * elapsed, 1000.0 * cs->connect_sum / n, 1000.0 * cs->connect_max,
+      1000.0 * cs->first_byte_sum / n, 1000.0 * cs->first_byte_max);
+  if (cs->failed)
+    printf("; %d failed validation", cs->failed);
+  printf(".\n");
+}
+
+// Print count, average, minimum, median, p99 and maximum of the n values (in seconds), which are sorted.
+void print_latency_summary(char const* what, double const* sorted, int n)
+{
+  if (n == 0)
+  {
+    printf("%-32s %6d\n", what, 0);
+    return;
+  }
+  double sum = 0;
+  for (int i = 0; i < n; ++i)
+    sum += sorted[i];
+  printf("%-32s %6d %9.1f %9.1f %9.1f %9.1f %9.1f\n", what, n, 1e6 * sum / n, 1e6 * sorted[0],
+      1e6 * percentile(sorted, n, 50), 1e6 * percentile(sorted, n, 99), 1e6 * sorted[n - 1]);
+}
+
+// Do n requests one after another, each over a new connection, and report the time between starting
+// the connect and receiving the first byte of the reply. With -F the first connection obtains a TFO
+// cookie from the server and the following ones send their request in the SYN.
+int run_reconnect_benchmark(int n)
+{
+  char header_buf[64];
+  double* ttfb = malloc(n * sizeof(double));
+  double* connect = malloc(n * sizeof(double));
+  CURL* easy = curl_easy_init();
+  wire_capture_setopt(easy, NULL);
+  curl_easy_setopt(easy, CURLOPT_URL, url);
+  curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT, 1L);
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_callback);
+  curl_easy_setopt(easy, CURLOPT_FRESH_CONNECT, 1L);
+  curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 1L);
+  if (fastopen)
+    curl_easy_setopt(easy, CURLOPT_TCP_FASTOPEN, 1L);
+  for (int i = 0; i < n; ++i)
+  {
+    struct curl_slist* headers = NULL;
+    snprintf(header_buf, sizeof header_buf, "X-Request: %d", i);
+    headers = curl_slist_append(headers, header_buf);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+    CURLcode res = curl_easy_perform(easy);
+    curl_slist_free_all(headers);
+    if (res != CURLE_OK)
+    {
+      printf("Request #%d failed: %s\n", i, curl_easy_strerror(res));
+      curl_easy_cleanup(easy);
+      return 1;
+    }
+    curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &ttfb[i]);
+    curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME, &connect[i]);
+  }
+  curl_easy_cleanup(easy);
+
+  printf("\nReconnect benchmark, %d connections, TCP Fast Open %s (times in microseconds):\n", n, fastopen ? "on" : "off");
+  printf("%-32s %6s %9s %9s %9s %9s %9s\n", "", "count", "avg", "min", "p50", "p99", "max");
+  print_latency_summary("first connect to first byte", ttfb, 1);
+  print_latency_summary("first connect", connect, 1);
+  // The first connection has no TFO cookie yet; the others (can) use the cookie.
+  qsort(ttfb + 1, n - 1, sizeof(double), compare_double);
+  qsort(connect + 1, n - 1, sizeof(double), compare_double);
+  print_latency_summary(fastopen ? "reconnect to first byte (cookie)" : "reconnect to first byte", ttfb + 1, n - 1);
+  print_latency_summary("reconnect", connect + 1, n - 1);
+  free(ttfb);
+  free(connect);
+  return 0;
+}
+
+int policy_calls = 0;			// The number of calls to policy_callback.
+int quiet_policy = 0;			// Don't print the calls to policy_callback (many hosts).
+
 void policy_callback(char const *hostname, int port, struct curl_pipeline_policy* policy, void *userp)
 {
-  printf("Calling policy_callback(%s:%d with max host connections = %lu, max pipelen = %ld and flags = %d\n",
-      hostname, port, policy->max_host_connections, policy->max_pipeline_length, policy->flags);
+  ++policy_calls;
+  if (!quiet_policy)
+    printf("Calling policy_callback(%s:%d with max host connections = %lu, max pipelen = %ld and flags = %d\n",
+	hostname, port, policy->max_host_connections, policy->max_pipeline_length, policy->flags);
   policy->flags = CURL_SUPPORTS_PIPELINING;
 }
 
+// Do n requests, keeping PIPELEN of them in flight, and store the CURLINFO_TOTAL_TIME of each in latency.
+// With fresh set, every request is made over a new connection that is closed after the reply
+// ("Connection: close"); otherwise they are pipelined over a single connection. Return the number
+// of connections that were made, or -1 if a request failed; *elapsed is set to the wall clock time.
+int run_batch(int n, int fresh, double* latency, double* elapsed)
+{
+  char header_buf[64];
+  CURLM* multi_handle = curl_multi_init();
+  if (!fresh)
+  {
+    curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, 1L);
+    curl_multi_setopt(multi_handle, CURLMOPT_MAX_PIPELINE_LENGTH, (long)PIPELEN);
+    curl_multi_setopt(multi_handle, CURLMOPT_PIPELINE_POLICY_FUNCTION, &policy_callback);
+  }
+  // Request -1 is not measured: it establishes that the server supports pipelining, or warms up
+  // the server in the fresh case.
+  int added = -1, done = -1, connects = 0, failed = 0;
+  struct timeval start_tv, end_tv;
+  while (done < n && !failed)
+  {
+    while (added < n && added - done < ((added < 0 || done < 0) ? 1 : PIPELEN))
+    {
+      struct request* req = calloc(1, sizeof(struct request));
+      CURL* easy = req->easy = curl_easy_init();
+      req->index = added++;
+      curl_easy_setopt(easy, CURLOPT_PRIVATE, req);
+      wire_capture_setopt(easy, req);
+      curl_easy_setopt(easy, CURLOPT_URL, url);
+      curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+      curl_easy_setopt(easy, CURLOPT_TIMEOUT, 1L);
+      curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_callback);
+      snprintf(header_buf, sizeof header_buf, "X-Request: %d", req->index);
+      req->headers = curl_slist_append(req->headers, header_buf);
+      if (fresh)
+      {
+	curl_easy_setopt(easy, CURLOPT_FRESH_CONNECT, 1L);
+	curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 1L);
+	req->headers = curl_slist_append(req->headers, "Connection: close");
+      }
+      curl_easy_setopt(easy, CURLOPT_HTTPHEADER, req->headers);
+      curl_multi_add_handle(multi_handle, easy);
+    }
+    int still_running;
+    curl_multi_perform(multi_handle, &still_running);
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(multi_handle, &msgs_left)))
+    {
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+      struct request* req;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&req);
+      if (msg->data.result != CURLE_OK)
+      {
+	printf("Request #%d failed: %s\n", req->index, curl_easy_strerror(msg->data.result));
+	failed = 1;
+      }
+      else if (req->index >= 0)
+      {
+	long num_connects;
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &latency[req->index]);
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_NUM_CONNECTS, &num_connects);
+	connects += num_connects;
+      }
+      if (++done == 0)
+	gettimeofday(&start_tv, NULL);
+      curl_multi_remove_handle(multi_handle, msg->easy_handle);
+      curl_easy_cleanup(msg->easy_handle);
+      curl_slist_free_all(req->headers);
+      free(req);
+    }
+    if (done < n && !failed)
+      curl_multi_wait(multi_handle, NULL, 0, 100, NULL);
+  }
+  gettimeofday(&end_tv, NULL);
+  timersub(&end_tv, &start_tv, &end_tv);
+  *elapsed = end_tv.tv_sec + end_tv.tv_usec * 1e-6;
+  curl_multi_cleanup(multi_handle);
+  return failed ? -1 : connects;
+}
+
+// Do n requests over fresh connections and then n pipelined requests, and compare the two.
+int run_fresh_connection_benchmark(int n)
+{
+  double* fresh_latency = malloc(n * sizeof(double));
+  double* pipelined_latency = malloc(n * sizeof(double));
+  double fresh_elapsed, pipelined_elapsed;
+  int fresh_connects = run_batch(n, 1, fresh_latency, &fresh_elapsed);
+  int pipelined_connects = fresh_connects < 0 ? -1 : run_batch(n, 0, pipelined_latency, &pipelined_elapsed);
+  if (pipelined_connects < 0)
+  {
+    free(fresh_latency);
+    free(pipelined_latency);
+    return 1;
+  }
+  qsort(fresh_latency, n, sizeof(double), compare_double);
+  qsort(pipelined_latency, n, sizeof(double), compare_double);
+  printf("\nFresh connections versus pipelining, %d requests, %d at a time (times in microseconds):\n", n, PIPELEN);
+  printf("%-32s %6s %9s %9s %9s %9s %9s\n", "", "count", "avg", "min", "p50", "p99", "max");
+  print_latency_summary("fresh connection per request", fresh_latency, n);
+  print_latency_summary("pipelined", pipelined_latency, n);
+  double fresh_avg = 0, pipelined_avg = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    fresh_avg += fresh_latency[i] / n;
+    pipelined_avg += pipelined_latency[i] / n;
+  }
+  printf("Fresh: %d connections in %.3f s: %.1f connections/s, %.1f requests/s.\n",
+      fresh_connects, fresh_elapsed, fresh_connects / fresh_elapsed, n / fresh_elapsed);
+  printf("Pipelined: %d connection(s) in %.3f s: %.1f requests/s.\n", pipelined_connects, pipelined_elapsed, n / pipelined_elapsed);
+  printf("Penalty of a fresh connection: %+.1f us per request (p50 %+.1f us), %.1f%% of the pipelined throughput.\n",
+      1e6 * (fresh_avg - pipelined_avg), 1e6 * (percentile(fresh_latency, n, 50) - percentile(pipelined_latency, n, 50)),
+      100.0 * pipelined_elapsed / fresh_elapsed);
+  free(fresh_latency);
+  free(pipelined_latency);
+  return 0;
+}
+
+// Request number i of the many hosts benchmark, for host number i % hosts.
+struct request* create_host_request(int i, int hosts, int port)
+{
+  char buf[128];
+  int host = i % hosts;
+  struct request* req = calloc(1, sizeof(struct request));
+  CURL* easy = req->easy = curl_easy_init();
+  req->index = i;
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, req);
+  wire_capture_setopt(easy, req);
+  snprintf(buf, sizeof buf, "http://host%d.pipeline.test:%d/", host, port);
+  curl_easy_setopt(easy, CURLOPT_URL, buf);
+  // Every host name is a different loopback address: 127.0.0.1, 127.0.0.2, ..., 127.0.1.0, ...
+  snprintf(buf, sizeof buf, "host%d.pipeline.test:%d:127.%d.%d.%d:%d", host, port,
+      ((host + 1) >> 16) & 255, ((host + 1) >> 8) & 255, (host + 1) & 255, port);
+  req->connect_to = curl_slist_append(NULL, buf);
+  curl_easy_setopt(easy, CURLOPT_CONNECT_TO, req->connect_to);
+  curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT, 10L);
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard_callback);
+  snprintf(buf, sizeof buf, "X-Request: %d", i);
+  req->headers = curl_slist_append(req->headers, buf);
+  curl_easy_setopt(easy, CURLOPT_HTTPHEADER, req->headers);
+  return req;
+}
+
+// Do per_host requests to each of 'hosts' different host names, with PIPELEN requests in flight
+// per host, and report how the request rate, the connections and the time spent in libcurl scale.
+int run_many_hosts_benchmark(int hosts, int per_host, int port)
+{
+  quiet_policy = 1;
+  CURLM* multi_handle = curl_multi_init();
+  curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, 1L);
+  curl_multi_setopt(multi_handle, CURLMOPT_MAX_PIPELINE_LENGTH, (long)PIPELEN);
+  curl_multi_setopt(multi_handle, CURLMOPT_PIPELINE_POLICY_FUNCTION, &policy_callback);
+  int n = hosts * per_host;
+  double* latency = malloc(n * sizeof(double));
+  // The first request to every host is done on its own: it establishes that the host supports pipelining.
+  int added = 0, done = 0, measured = 0, connects = 0, failed = 0, max_in_flight = hosts;
+  long perform_calls = 0;
+  double perform_time = 0;
+  struct timeval start_tv, end_tv, diff_tv;
+  gettimeofday(&start_tv, NULL);
+  while (done < hosts + n && !failed)
+  {
+    while (added < hosts + n && added - done < max_in_flight)
+    {
+      struct request* req = create_host_request(added++, hosts, port);
+      curl_multi_add_handle(multi_handle, req->easy);
+    }
+    int still_running;
+    struct timeval before_tv, after_tv;
+    gettimeofday(&before_tv, NULL);
+    curl_multi_perform(multi_handle, &still_running);
+    gettimeofday(&after_tv, NULL);
+    timersub(&after_tv, &before_tv, &diff_tv);
+    perform_time += diff_tv.tv_sec + diff_tv.tv_usec * 1e-6;
+    ++perform_calls;
+    CURLMsg* msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(multi_handle, &msgs_left)))
+    {
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+      struct request* req;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&req);
+      if (msg->data.result != CURLE_OK)
+      {
+	printf("Request #%d (host %d) failed: %s\n", req->index, req->index % hosts, curl_easy_strerror(msg->data.result));
+	failed = 1;
+      }
+      else if (req->index >= hosts)
+      {
+	long num_connects;
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &latency[measured++]);
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_NUM_CONNECTS, &num_connects);
+	connects += num_connects;
+      }
+      if (++done == hosts)
+      {
+	// Start of the measured phase.
+	gettimeofday(&start_tv, NULL);
+	max_in_flight = hosts * PIPELEN;
+	perform_calls = 0;
+	perform_time = 0;
+      }
+      curl_multi_remove_handle(multi_handle, msg->easy_handle);
+      curl_easy_cleanup(msg->easy_handle);
+      curl_slist_free_all(req->headers);
+      curl_slist_free_all(req->connect_to);
+      free(req);
+    }
+    if (done < hosts + n && !failed)
+      curl_multi_wait(multi_handle, NULL, 0, 100, NULL);
+  }
+  gettimeofday(&end_tv, NULL);
+  timersub(&end_tv, &start_tv, &diff_tv);
+  double elapsed = diff_tv.tv_sec + diff_tv.tv_usec * 1e-6;
+  curl_multi_cleanup(multi_handle);
+  if (!failed)
+  {
+    qsort(latency, measured, sizeof(double), compare_double);
+    printf("\nMany hosts benchmark, %d hosts, %d requests per host, %d in flight per host (times in microseconds):\n", hosts, per_host, PIPELEN);
+    printf("%-32s %6s %9s %9s %9s %9s %9s\n", "", "count", "avg", "min", "p50", "p99", "max");
+    print_latency_summary("request", latency, measured);
+    printf("%d requests in %.3f s: %.1f requests/s; %d new connections (%.2f per host); %d policy_callback calls.\n",
+	measured, elapsed, measured / elapsed, connects, (double)connects / hosts, policy_calls);
+    printf("%ld calls to curl_multi_perform, %.1f us per call, %.1f us per request.\n",
+	perform_calls, 1e6 * perform_time / perform_calls, 1e6 * perform_time / measured);
+  }
+  free(latency);
+  return failed;
+}
+
 int main(int argc, char* argv[])
 {
   char const* hostname = "localhost";
@@ -128,14 +1403,149 @@ int main(int argc, char* argv[])
 
   opterr = 0;
 
-  while ((c = getopt(argc, argv, "p:")) != -1)
+  char const* upload_file = NULL;
+  int reconnects = 0;
+  int fresh_requests = 0;
+  int many_hosts = 0;
+  int per_host = 20;
+
+  while ((c = getopt(argc, argv, "p:m:u:f:si:d:FR:C:r:P:S:M:W:w:")) != -1)
     switch (c)
     {
       case 'p':
 	port = atoi(optarg);
 	break;
+      case 'm':
+	if (strcasecmp(optarg, "POST") == 0)
+	  upload_method = "POST";
+	else if (strcasecmp(optarg, "PUT") == 0)
+	  upload_method = "PUT";
+	else
+	{
+	  fprintf(stderr, "Unsupported method '%s' (use POST or PUT).\n", optarg);
+	  return 1;
+	}
+	break;
+      case 'u':
+	if (!parse_upload_sizes(optarg))
+	  return 1;
+	break;
+      case 'f':
+	upload_file = optarg;
+	break;
+      case 's':
+	soak = 1;
+	break;
+      case 'i':
+	soak_interval = atoi(optarg);
+	if (soak_interval <= 0)
+	{
+	  fprintf(stderr, "Invalid interval '%s'.\n", optarg);
+	  return 1;
+	}
+	break;
+      case 'd':
+	soak_sleep = atoi(optarg);
+	break;
+      case 'F':
+	fastopen = 1;
+	break;
+      case 'R':
+	reconnects = atoi(optarg);
+	if (reconnects < 2)
+	{
+	  fprintf(stderr, "-R needs at least 2 connections.\n");
+	  return 1;
+	}
+	break;
+      case 'C':
+	fresh_requests = atoi(optarg);
+	if (fresh_requests < 1)
+	{
+	  fprintf(stderr, "Invalid number of requests '%s'.\n", optarg);
+	  return 1;
+	}
+	break;
+      case 'r':
+      {
+	char* end;
+	max_recv_speed = parse_size(optarg, &end);
+	if (end == optarg || *end || max_recv_speed <= 0)
+	{
+	  fprintf(stderr, "Invalid receive speed '%s'.\n", optarg);
+	  return 1;
+	}
+	break;
+      }
+      case 'P':
+	pause_ms = atoi(optarg);
+	if (pause_ms <= 0)
+	{
+	  fprintf(stderr, "Invalid pause '%s'.\n", optarg);
+	  return 1;
+	}
+	break;
+      case 'S':
+      {
+	char* end;
+	stall_ms = strtol(optarg, &end, 10);
+	if (*end == '/')
+	  stall_period_ms = strtol(end + 1, &end, 10);
+	if (*end || stall_ms <= 0 || stall_period_ms <= stall_ms)
+	{
+	  fprintf(stderr, "Invalid stall '%s' (use MS or MS/PERIOD_MS, with MS < PERIOD_MS).\n", optarg);
+	  return 1;
+	}
+	break;
+      }
+      case 'M':
+      {
+	char* end;
+	many_hosts = strtol(optarg, &end, 10);
+	if (*end == '/')
+	  per_host = strtol(end + 1, &end, 10);
+	if (*end || many_hosts < 1 || many_hosts > 16000000 || per_host < 1)
+	{
+	  fprintf(stderr, "Invalid number of hosts '%s' (use HOSTS or HOSTS/REQUESTS_PER_HOST).\n", optarg);
+	  return 1;
+	}
+	break;
+      }
+      case 'W':
+      {
+	char* end;
+	pool_size = strtol(optarg, &end, 10);
+	if (*end == '/')
+	  keepalive_s = strtol(end + 1, &end, 10);
+	if (*end || pool_size < 1 || keepalive_s < 0)
+	{
+	  fprintf(stderr, "Invalid pool '%s' (use CONNECTIONS or CONNECTIONS/KEEPALIVE_SECONDS).\n", optarg);
+	  return 1;
+	}
+	break;
+      }
+      case 'w':
+      {
+	// -w FILE[,MEGABYTES]
+	char* comma = strrchr(optarg, ',');
+	long megabytes = 64;
+	if (comma)
+	{
+	  char* end;
+	  megabytes = strtol(comma + 1, &end, 10);
+	  if (*end || megabytes < 1)
+	  {
+	    fprintf(stderr, "Invalid capture '%s' (use FILE or FILE,MEGABYTES).\n", optarg);
+	    return 1;
+	  }
+	  *comma = 0;
+	}
+	if (!wire_capture_start(optarg, (size_t)megabytes << 20))
+	  return 1;
+	break;
+      }
       case '?':
-	if (optopt == 'p')
+	if (strchr("pmufidRCrPSMWw", optopt))
 	  fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 	else if (isprint(optopt))
 	  fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -151,74 +1561,79 @@ int main(int argc, char* argv[])
     hostname = argv[optind];
   }
 
-  char url[256];
+  // Uploading is enabled by either -m or -u; the default is to PUT 64 kB bodies.
+  if (upload_method || nr_upload_sizes > 0 || upload_file)
+  {
+    if (!upload_method)
+      upload_method = "PUT";
+    if (nr_upload_sizes == 0)
+      upload_stats[nr_upload_sizes++].size = 65536;
+    size_t max_size = 0;
+    for (int i = 0; i < nr_upload_sizes; ++i)
+      if (upload_stats[i].size > max_size)
+	max_size = upload_stats[i].size;
+    if (!map_upload_source(upload_file, max_size))
+      return 1;
+  }
+
   snprintf(url, sizeof(url), "http://%s:%d/", hostname, port);
   printf("Connecting to '%s'...\n", url);
 
+  if (reconnects)
+    return run_reconnect_benchmark(reconnects);
+  if (fresh_requests)
+    return run_fresh_connection_benchmark(fresh_requests);
+  if (many_hosts)
+    return run_many_hosts_benchmark(many_hosts, per_host, port);
+
   // Initialize the CURL multi handle.
   CURLM* multi_handle = curl_multi_init();
   curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, 1L);
   curl_multi_setopt(multi_handle, CURLMOPT_MAX_PIPELINE_LENGTH, (long)NRREQUESTS);
   curl_multi_setopt(multi_handle, CURLMOPT_PIPELINE_POLICY_FUNCTION, &policy_callback);
 
-  // Custom headers.
-  struct curl_slist* headers[NRREQUESTS];
-  memset(headers, 0, sizeof headers);
-  char header_buf[256];
-
-  // Initialize all CURL easy handles.
-  CURL* handles[NRREQUESTS];
-  for (int i = 0; i < NRREQUESTS; ++i)
-  {
-    handles[i] = curl_easy_init();
-    curl_easy_setopt(handles[i], CURLOPT_STDERR, stdout);
-    curl_easy_setopt(handles[i], CURLOPT_VERBOSE, VERBOSE ? 1L : 0L);
-    curl_easy_setopt(handles[i], CURLOPT_HTTPGET, 1L);
-    curl_easy_setopt(handles[i], CURLOPT_TIMEOUT, (i == 3) ? 10L : 1L);					// Timeout after 1 seconds.
-    curl_easy_setopt(handles[i], CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
-    curl_easy_setopt(handles[i], CURLOPT_URL, url);
-    // Construct the headers.
-    snprintf(header_buf, sizeof header_buf, "X-Sleep: %d", (i != 1) ? 100 : 1100);	// Server delays reply 0.1 seconds except for request #1, which will be 1.1 seconds delayed.
-    if (i > 0)	// No delay for the first one, which is just to establish that the server supports http pipelining.
-      headers[i] = curl_slist_append(headers[i], header_buf);
-    snprintf(header_buf, sizeof header_buf, "X-Request: %d", i);			// The requests are numbered 0 through NRREQUESTS - 1.
-    headers[i] = curl_slist_append(headers[i], header_buf);
-    if (i == 7)
-    {
-      snprintf(header_buf, sizeof header_buf, "X-Disconnect: yes");
-      headers[i] = curl_slist_append(headers[i], header_buf);
-    }
-    curl_easy_setopt(handles[i], CURLOPT_HTTPHEADER, headers[i]);
-  }
-
-  // The number of actually added easy handles so far. It is (therefore) also used as index
-  // to the handles[] array to read the next easy handle to add.
+  // The number of actually added easy handles so far. It is (therefore) also used as the
+  // index of the next request to add.
   int added = 0;
   // This variable keeps track of how many easy handles were added (added) minus the number of finished.
   // In other words, the number that is still running.
   int running = 0;
 
+  // Everything until the measured phase is the cold start.
+  struct timeval cold_tv;
+  gettimeofday(&cold_tv, NULL);
+
   // Start with adding just one handle - until libcurl saw that it supports pipelining.
   // Otherwise it will create many connections - instead of 1.
-  add_next_handle(multi_handle, handles, &added, &running);
+  add_next_handle(multi_handle, &added, &running);
 
   // Brute force let this finish.. it's not really important - just to make sure
   // that libcurl start to do pipelining for this url.
   int still_running;
-  do { curl_multi_perform(multi_handle, &still_running); } while (still_running);
-  process_results(multi_handle, handles, headers, &running);
+  do { curl_multi_perform(multi_handle, &still_running); unpause_expired(); } while (still_running);
+  process_results(multi_handle, &running);
+
+  // Pre-warm the rest of the connection pool (-W).
+  if (pool_size > 1)
+    warm_pool(multi_handle);
 
   //==========================================================================================
   // THE REAL TEST STARTS HERE
 
+  struct timeval start_tv, last_report_tv, cold_elapsed_tv;
+  gettimeofday(&start_tv, NULL);
+  last_report_tv = start_tv;
+  timersub(&start_tv, &cold_tv, &cold_elapsed_tv);
+  print_cold_start(cold_elapsed_tv.tv_sec + cold_elapsed_tv.tv_usec * 1e-6);
+
   // Run until nothing is running anymore.
   for (;;)
   {
     // Keep PIPELEN requests in the pipeline, until we run out of easy handles.
-    for (int n = still_running; n < PIPELEN && added < NRREQUESTS; ++n)
+    for (int n = still_running; n < PIPELEN && more_requests(added); ++n)
     {
-      // Add the next (already prepared) easy handle.
-      add_next_handle(multi_handle, handles, &added, &running);
+      // Add the next easy handle.
+      add_next_handle(multi_handle, &added, &running);
     }
 
     // Call curl_multi_perform.
@@ -227,11 +1642,28 @@ int main(int argc, char* argv[])
     if (VERBOSE) printf("still_running = %d\n", still_running);
 
     // Print debug output when anything finished, and update 'running'.
-    process_results(multi_handle, handles, headers, &running);
+    process_results(multi_handle, &running);
+
+    // Continue paused transfers whose time is up.
+    long unpause_timeout = unpause_expired();
+
+    if (soak)
+    {
+      struct timeval now_tv, diff_tv;
+      gettimeofday(&now_tv, NULL);
+      timersub(&now_tv, &last_report_tv, &diff_tv);
+      if (diff_tv.tv_sec >= soak_interval)
+      {
+	double elapsed = diff_tv.tv_sec + diff_tv.tv_usec * 1e-6;
+	timersub(&now_tv, &start_tv, &diff_tv);
+	soak_report(diff_tv.tv_sec + diff_tv.tv_usec * 1e-6, elapsed, running);
+	last_report_tv = now_tv;
+      }
+    }
 
     // Exit the main loop when we're done.
     if (running == 0 &&		// all done
-	added == NRREQUESTS)	// nothing else to add
+	!more_requests(added))	// nothing else to add
       break;
 
     // At this point we might have less than PIPELEN requests in the pipeline again
@@ -239,7 +1671,7 @@ int main(int argc, char* argv[])
     // However, at this point is it possible that the select() call below will
     // have a timeout and will sleep. We don't want that; so immediately refill the
     // pipe.
-    if (still_running < PIPELEN && added < NRREQUESTS)
+    if (still_running < PIPELEN && more_requests(added))
       continue;
 
     // Obtain the next timeout by calling curl_multi_timeout().
@@ -254,6 +1686,12 @@ int main(int argc, char* argv[])
       else
 	timeout.tv_usec = (curl_timeo % 1000) * 1000;
     }
+    // Don't sleep past the end of a pause.
+    if (unpause_timeout >= 0 && unpause_timeout < timeout.tv_sec * 1000 + timeout.tv_usec / 1000)
+    {
+      timeout.tv_sec = unpause_timeout / 1000;
+      timeout.tv_usec = (unpause_timeout % 1000) * 1000;
+    }
 
     // Obtain the other parameters needed for select() by calling curl_multi_fdset().
     fd_set fdread;
@@ -281,13 +1719,24 @@ int main(int argc, char* argv[])
 
   } // Main loop.
 
+  print_throttle_stats();
+  long validation_failures = print_validation();
+
+  if (upload_method)
+  {
+    struct timeval end_tv, elapsed_tv;
+    gettimeofday(&end_tv, NULL);
+    timersub(&end_tv, &start_tv, &elapsed_tv);
+    print_upload_stats(elapsed_tv.tv_sec + elapsed_tv.tv_usec * 1e-6);
+  }
+
   //==========================================================================================
   // Clean up.
 
   // Clean up the multi handle.
   curl_multi_cleanup(multi_handle);
 
-  return 0;
+  return validation_failures > 0 ? 1 : 0;
 }
 
 #else // CURL_SUPPORTS_PIPELINING
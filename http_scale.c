@@ -0,0 +1,448 @@
+// Connection scale test for http_server.
+//
+// A single source address can only open about 28k connections (the ephemeral
+// port range) to the same server port. This program binds every client
+// socket to one of many loopback source addresses (127.1.0.1, 127.1.0.2, ...,
+// all of 127.0.0.0/8 is routed to lo) and so can open up to a million
+// connections to a server on 127.0.0.1. Most connections stay idle (keep-alive);
+// every burst period a few random idle connections send a pipelined burst of
+// requests, and the latency of those replies is measured while the idle
+// population grows. With -S every connection instead subscribes to the
+// broadcast events of http_server --publish and counts the events it receives.
+//
+// Compile this as:
+//
+// gcc -std=c11 -O2 -o http_scale http_scale.c -lm
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+// The number of connections that are connecting at the same time, at most.
+#define MAX_CONNECTING 1024
+// The end of the reply body of http_server (without X-Size). The first character does not occur in the rest.
+static char const reply_end[] = "</html>\n";
+// The end of a broadcast event.
+static char const event_end[] = "\n\n";
+
+enum conn_state { conn_unused, conn_connecting, conn_idle, conn_busy, conn_subscribed, conn_closed };
+
+// Per connection state; the index in the connections array is stored in the epoll data.
+struct conn
+{
+  int fd;
+  unsigned char state;			// One of conn_state.
+  unsigned char match;			// The number of characters of reply_end (or event_end) matched so far.
+  unsigned short outstanding;		// The number of replies of the current burst that didn't arrive yet.
+  unsigned int burst_us;		// When the current burst was sent, in microseconds since start.
+};
+
+// The statistics of the current report interval.
+struct interval_stats
+{
+  int connected;			// Connections that finished connecting.
+  int failed;				// Connections that failed to connect.
+  int closed;				// Established connections that were closed by the server.
+  double* latency;			// Reply latencies of the bursts, in microseconds.
+  int replies;
+  int latency_capacity;
+  long events;				// Broadcast events received by the subscribers.
+};
+
+int port = 9001;
+int nr_connections = 10000;		// The number of connections to open (-n).
+int nr_addresses = 0;			// The number of source addresses (-a), or 0 for as many as needed.
+int connect_rate = 20000;		// Connections per second during the ramp (-r).
+int hold_seconds = 60;			// Seconds to keep running after the ramp (-t).
+int report_interval = 1;		// Seconds between reports (-i).
+int burst_period_ms = 100;		// Milliseconds between bursts (-b).
+int burst_connections = 16;		// The number of connections that send a burst (-k).
+int burst_depth = 4;			// The number of pipelined requests per burst (-d).
+pid_t server_pid = 0;			// The pid of the server, to read its RSS (-s).
+int subscribe = 0;			// Every connection subscribes to the broadcast events (-S).
+
+struct conn* connections;
+int epoll_fd;
+int opened, established, connecting, failed_total;
+struct interval_stats stats;
+
+// Return the number of microseconds since the first call.
+unsigned int now_us()
+{
+  static struct timespec start;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!start.tv_sec && !start.tv_nsec)
+    start = now;
+  return (now.tv_sec - start.tv_sec) * 1000000U + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+// Return the resident set size of process pid in kB, or 0 if it can't be read.
+long resident_set_size(pid_t pid)
+{
+  char path[64];
+  long size, resident = 0;
+  snprintf(path, sizeof path, "/proc/%d/statm", (int)pid);
+  FILE* statm = fopen(path, "r");
+  if (statm)
+  {
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+      resident = 0;
+    fclose(statm);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int compare_double(void const* a, void const* b)
+{
+  double x = *(double const*)a, y = *(double const*)b;
+  return (x > y) - (x < y);
+}
+
+// Return the pct percentile of the n sorted values.
+double percentile(double const* sorted, int n, double pct)
+{
+  if (n == 0)
+    return 0.0;
+  int i = (int)ceil(pct / 100.0 * n) - 1;
+  return sorted[i < 0 ? 0 : i];
+}
+
+void add_latency(double latency)
+{
+  if (stats.replies == stats.latency_capacity)
+  {
+    stats.latency_capacity = stats.latency_capacity ? 2 * stats.latency_capacity : 1024;
+    stats.latency = realloc(stats.latency, stats.latency_capacity * sizeof(double));
+  }
+  stats.latency[stats.replies++] = latency;
+}
+
+// Close connection i; the slot is not reused.
+void close_connection(int i)
+{
+  struct conn* c = &connections[i];
+  if (c->state == conn_connecting)
+    --connecting;
+  else if (c->state == conn_idle || c->state == conn_busy || c->state == conn_subscribed)
+    --established;
+  close(c->fd);
+  c->fd = -1;
+  c->state = conn_closed;
+}
+
+// Start connecting the next connection from the next source address.
+int open_connection()
+{
+  int i = opened++;
+  struct conn* c = &connections[i];
+  struct sockaddr_in source, server;
+
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd == -1)
+  {
+    perror("socket");
+    return 0;
+  }
+  // Let connect() pick the port, so that the same port can be used with different destinations.
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof one);
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  memset(&source, 0, sizeof source);
+  source.sin_family = AF_INET;
+  source.sin_addr.s_addr = htonl(0x7f010001 + i % nr_addresses);		// 127.1.0.1 + i % nr_addresses.
+  if (bind(c->fd, (struct sockaddr*)&source, sizeof source) == -1)
+  {
+    perror("bind");
+    return 0;
+  }
+  memset(&server, 0, sizeof server);
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  c->state = conn_connecting;
+  ++connecting;
+  if (connect(c->fd, (struct sockaddr*)&server, sizeof server) == -1 && errno != EINPROGRESS)
+  {
+    if (!failed_total++)
+      perror("connect");
+    ++stats.failed;
+    close_connection(i);
+    return 1;
+  }
+  struct epoll_event event;
+  event.events = EPOLLOUT;
+  event.data.u32 = i;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+  return 1;
+}
+
+// Connection i finished connecting (or failed to).
+void handle_connect(int i)
+{
+  struct conn* c = &connections[i];
+  int error = 0;
+  socklen_t len = sizeof error;
+  getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+  if (error)
+  {
+    if (!failed_total++)
+      fprintf(stderr, "connect: %s\n", strerror(error));
+    ++stats.failed;
+    close_connection(i);
+    return;
+  }
+  --connecting;
+  ++established;
+  ++stats.connected;
+  c->state = conn_idle;
+  if (subscribe)
+  {
+    char buf[128];
+    size_t len = snprintf(buf, sizeof buf, "GET /subscribe/0 HTTP/1.1\r\nHost: localhost:%d\r\n\r\n", port);
+    if (write(c->fd, buf, len) != (ssize_t)len)
+    {
+      ++stats.closed;
+      close_connection(i);
+      return;
+    }
+    c->state = conn_subscribed;
+  }
+  // From now on only wait for replies (or the server closing the connection).
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u32 = i;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+// Read the replies that arrived on connection i.
+void handle_read(int i)
+{
+  struct conn* c = &connections[i];
+  char buf[16384];
+  ssize_t len;
+  while ((len = read(c->fd, buf, sizeof buf)) > 0)
+  {
+    if (c->state == conn_subscribed)
+    {
+      for (char const* p = buf; p < buf + len; ++p)
+      {
+	c->match = *p == event_end[c->match] ? c->match + 1 : *p == event_end[0];
+	if (!event_end[c->match])
+	{
+	  c->match = 0;
+	  ++stats.events;
+	}
+      }
+      continue;
+    }
+    for (char const* p = buf; p < buf + len; ++p)
+    {
+      c->match = *p == reply_end[c->match] ? c->match + 1 : *p == reply_end[0];
+      if (!reply_end[c->match])
+      {
+	c->match = 0;
+	if (c->outstanding && --c->outstanding == 0)
+	  c->state = conn_idle;
+	add_latency(now_us() - c->burst_us);
+      }
+    }
+  }
+  if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+  {
+    ++stats.closed;
+    close_connection(i);
+  }
+}
+
+// Send a burst of pipelined requests over burst_connections random idle connections.
+void send_bursts()
+{
+  static int request;
+  char buf[4096];
+  if (!opened)
+    return;
+  for (int k = 0, tries = 0; k < burst_connections && tries < 4 * burst_connections; ++tries)
+  {
+    int i = random() % opened;
+    struct conn* c = &connections[i];
+    if (c->state != conn_idle)
+      continue;
+    size_t len = 0;
+    for (int r = 0; r < burst_depth; ++r)
+      len += snprintf(buf + len, sizeof buf - len,
+	  "GET / HTTP/1.1\r\nHost: localhost:%d\r\nX-Sleep: 0\r\nX-Request: %d\r\n\r\n", port, request++);
+    c->burst_us = now_us();
+    if (write(c->fd, buf, len) != (ssize_t)len)
+    {
+      ++stats.closed;
+      close_connection(i);
+      continue;
+    }
+    c->outstanding = burst_depth;
+    c->state = conn_busy;
+    ++k;
+  }
+}
+
+void report(double t, double elapsed, long rss0)
+{
+  long rss = server_pid ? resident_set_size(server_pid) : 0;
+  qsort(stats.latency, stats.replies, sizeof(double), compare_double);
+  printf("SCALE t=%.1fs: connections %d (%.0f/s accepted, %d connecting, %d failed, %d closed)",
+      t, established, stats.connected / elapsed, connecting, stats.failed, stats.closed);
+  if (server_pid)
+    printf("; server RSS %ld kB (%.2f kB per connection)", rss, established ? (double)(rss - rss0) / established : 0.0);
+  printf("; active latency us p50 %.0f p99 %.0f max %.0f (%d replies)\n",
+      percentile(stats.latency, stats.replies, 50), percentile(stats.latency, stats.replies, 99),
+      stats.replies ? stats.latency[stats.replies - 1] : 0.0, stats.replies);
+  if (subscribe)
+    printf("EVENTS t=%.1fs: %.0f events/s received (%.2f per subscriber per second)\n",
+	t, stats.events / elapsed, established ? stats.events / elapsed / established : 0.0);
+  fflush(stdout);
+  stats.connected = stats.failed = stats.closed = stats.replies = 0;
+  stats.events = 0;
+}
+
+void usage(char const* name)
+{
+  fprintf(stderr, "Usage: %s [-p port] [-n connections] [-a addresses] [-r rate] [-t seconds] [-i seconds]\n"
+      "       [-b ms] [-k connections] [-d depth] [-s server_pid] [-S]\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "p:n:a:r:t:i:b:k:d:s:S")) != -1)
+    switch (c)
+    {
+      case 'p':
+	port = atoi(optarg);
+	break;
+      case 'n':
+	nr_connections = atoi(optarg);
+	break;
+      case 'a':
+	nr_addresses = atoi(optarg);
+	break;
+      case 'r':
+	connect_rate = atoi(optarg);
+	break;
+      case 't':
+	hold_seconds = atoi(optarg);
+	break;
+      case 'i':
+	report_interval = atoi(optarg);
+	break;
+      case 'b':
+	burst_period_ms = atoi(optarg);
+	break;
+      case 'k':
+	burst_connections = atoi(optarg);
+	break;
+      case 'd':
+	burst_depth = atoi(optarg);
+	break;
+      case 's':
+	server_pid = atoi(optarg);
+	break;
+      case 'S':
+	subscribe = 1;
+	break;
+      default:
+	usage(argv[0]);
+	return 1;
+    }
+  if (nr_connections <= 0 || nr_addresses < 0 || connect_rate <= 0 || report_interval <= 0 ||
+      burst_period_ms <= 0 || burst_depth <= 0 || burst_depth > 64)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  // Stay well below the ephemeral port range per source address.
+  if (!nr_addresses)
+    nr_addresses = nr_connections / 20000 + 1;
+
+  // Every connection needs a file descriptor.
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < (rlim_t)nr_connections + 16)
+    fprintf(stderr, "WARNING: the open files limit is %lu; raise it (ulimit -n) for %d connections.\n",
+	(unsigned long)limit.rlim_cur, nr_connections);
+
+  connections = calloc(nr_connections, sizeof(struct conn));
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (!connections || epoll_fd == -1)
+  {
+    perror("http_scale");
+    return 1;
+  }
+  printf("Opening %d connections to port %d from %d source addresses (127.1.0.1 ...), %d per second.\n",
+      nr_connections, port, nr_addresses, connect_rate);
+
+  long rss0 = server_pid ? resident_set_size(server_pid) : 0;
+  unsigned int start = now_us();
+  unsigned int last_report = start, next_burst = start;
+  unsigned int ramp_end = 0;
+  struct epoll_event events[256];
+
+  for (;;)
+  {
+    unsigned int now = now_us();
+    // Open as many connections as the ramp allows by now.
+    long due = (long)((double)(now - start) * connect_rate / 1e6) + 1;
+    while (opened < nr_connections && opened < due && connecting < MAX_CONNECTING)
+      if (!open_connection())
+	return 1;
+    if (opened == nr_connections && !connecting && !ramp_end)
+    {
+      ramp_end = now;
+      printf("Ramp done after %.1f seconds: %d connections established.\n", (now - start) / 1e6, established);
+    }
+    if (ramp_end && now - ramp_end >= hold_seconds * 1000000U)
+      break;
+    if ((int)(now - next_burst) >= 0)
+    {
+      send_bursts();
+      next_burst += burst_period_ms * 1000U;
+    }
+    if (now - last_report >= report_interval * 1000000U)
+    {
+      report((now - start) / 1e6, (now - last_report) / 1e6, rss0);
+      last_report = now;
+    }
+
+    int n = epoll_wait(epoll_fd, events, 256, 1);
+    for (int e = 0; e < n; ++e)
+    {
+      int i = events[e].data.u32;
+      if (connections[i].state == conn_connecting)
+	handle_connect(i);
+      else if (connections[i].state == conn_idle || connections[i].state == conn_busy || connections[i].state == conn_subscribed)
+	handle_read(i);
+    }
+  }
+  unsigned int now = now_us();
+  if (now - last_report >= 100000)
+    report((now - start) / 1e6, (now - last_report) / 1e6, rss0);
+  return 0;
+}
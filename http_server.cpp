@@ -1,10 +1,12 @@
 // Compile this as:
 //
-// g++ -O2 -o http_server http_server.cpp -lboost_system
+// g++ -O2 -o http_server http_server.cpp -lboost_system -ldl -pthread -rdynamic
+//     -Wl,--wrap=recv,--wrap=send,--wrap=recvmsg,--wrap=sendmsg,--wrap=readv,--wrap=writev,--wrap=epoll_wait,--wrap=epoll_ctl,--wrap=timerfd_settime
 //
 // Then just run ./http_server
 //
-// The application will listen on port 9001 and accept
+// The application will listen on port 9001 (or the port
+// passed with --port) and accept
 // any number of connections - each connection is
 // kept alive and a short text/html reply is sent
 // back to the client each time the pattern "\r\n\r\n"
@@ -18,22 +20,144 @@
 // and a "X-Reply:" that enumerates the order in which replies
 // were generated (which should be the same as the order in
 // which the corresponding request was received obviously).
+//
+// "X-Sleep-Us: XXX" does the same in microseconds. Sleeps use absolute
+// deadlines, counted from when the request was received, on the steady
+// clock; with --spin-us N the timer fires N microseconds early and the
+// remainder is spent spinning, for sub-10 microsecond accuracy. In soak
+// mode the timer overshoot (actual minus requested wake up time) is
+// reported every interval.
+//
+// The size of the reply body can be increased with "X-Size: XXX"
+// (bytes) and with "X-Chunks: XXX" the reply is sent with chunked
+// transfer encoding, split into XXX chunks.
+//
+// With "X-Subscribe: XXX" the epoll engine replies with an event stream
+// (text/event-stream, chunked) of the next XXX events that it broadcasts
+// with --publish, or of all of them if XXX is 0; the asio engine sends
+// the normal reply.
+//
+// The same controls can be given in the request target, so that load
+// generators that can't set headers per request can use them, either
+// as path segments or as a query string; for example:
+//
+//   GET /sleep/100/size/4096/chunks/8 HTTP/1.1
+//   GET /?sleep=100&request=3 HTTP/1.1
+//
+// Values in the target take precedence over headers.
+//
+// A request with "Connection: close", or an HTTP/1.0 request without
+// "Connection: keep-alive", is the last one on its connection: its reply
+// has "Connection: close", anything pipelined after it is discarded and
+// once the reply is written the server shuts down its sending side and
+// then discards input until the client closes (or for at most
+// linger_timeout seconds) before closing the socket (lingering close).
+//
+// Requests with a body (POST, PUT) must have a "Content-Length: XXX"
+// header; the body is skipped and the reply is queued after the
+// last byte of the body was received.
+//
+// Run ./http_server --help for the command line options. In soak mode
+// (--soak) the per byte output is suppressed and instead statistics
+// are printed every --interval seconds, including the growth rate of
+// the resident set size and the number of open file descriptors.
+//
+// With --lag-monitor MS a watchdog thread posts a probe handler to the
+// event loop every MS milliseconds and measures how long it takes until
+// it runs (event loop lag). When a probe is still waiting after
+// --lag-threshold milliseconds, the event loop thread is interrupted
+// and prints a backtrace of the handler that it is stuck in.
+//
+// The system calls that asio makes on behalf of the server are counted
+// (through the linker's --wrap) and reported per request in soak mode
+// and by the socketpair benchmark.
+//
+// With --control PATH a server listens on the unix socket PATH for a
+// successor: starting a new server with the same --control PATH hands
+// the listening socket (and with --handoff-idle the idle keep-alive
+// connections) over to the new process, while the old process finishes
+// the requests that it already read and then exits.
+//
+// With --proxy HOST:PORT the server is a reverse proxy: every request
+// is forwarded over one of a pool of pipelined upstream connections to
+// the backend (normally another http_server) and the replies are sent
+// back to the client in the order of its requests, with the X-Connection
+// and X-Reply headers of the proxy and an X-Upstream header added.
+//
+// With --plugin PATH a shared object is loaded that can claim headers
+// and request target keys of its own and produce the replies for them;
+// see http_server_plugin.h.
+//
+// With --bench-socketpair N the server doesn't listen at all: it pipelines
+// N requests into a connection over an AF_UNIX socketpair from within the
+// same process and reports the time spent per request in each phase of
+// the connection (parse, queue, format, write). Run it under perf record
+// to profile the user-space cost of the server without TCP.
+//
+// With --perf-counters the same phases are also measured with hardware
+// performance counters (cycles, instructions, cache and branch misses),
+// or with software counters if the PMU isn't accessible; the results
+// are printed by the socketpair benchmark and, in soak mode, per interval.
+//
+// With --access-log PREFIX every reply is recorded in a binary access log
+// (time stamps, connection, request, reply number, size, sleep, status and
+// head-of-line delay) in memory mapped segment files; see access_log.h and
+// http_accesslog.
 
 #include <ctime>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <stdexcept>
+#include <vector>
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <iomanip>
 #include <string>
 #include <deque>
+#include <set>
+#include <map>
+#include <queue>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <numeric>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/array.hpp>
+#include <getopt.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <execinfo.h>
+#include "http_server_plugin.h"
+#include "access_log.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <climits>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <linux/perf_event.h>
+#include <netinet/tcp.h>
 
 using boost::asio::ip::tcp;
 
+typedef boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN> tcp_fastopen;
+
 #if BOOST_VERSION >= 107000
 #define GET_IO_SERVICE(s) ((boost::asio::io_context&)(s).get_executor().context())
 #else
@@ -42,7 +166,7 @@ using boost::asio::ip::tcp;
 
 char const* const reply =
     "HTTP/1.1 200 OK\r\n"
-    "Keep-Alive: timeout=10 max=400\r\n"
+    "%s"
     "Content-Length: %lu\r\n"
     "Content-Type: text/html\r\n"
     "X-Connection: %d\r\n"
@@ -51,22 +175,661 @@ char const* const reply =
     "\r\n"
     "<html><body>%s</body></html>\n";
 
+// Used instead of 'reply' for replies with X-Size or X-Chunks; the second argument is
+// either a Content-Length or a Transfer-Encoding header.
+char const* const reply_head =
+    "HTTP/1.1 200 OK\r\n"
+    "%s"
+    "%s"
+    "Content-Type: text/html\r\n"
+    "X-Connection: %d\r\n"
+    "X-Request: %lu\r\n"
+    "X-Reply: %d\r\n"
+    "\r\n";
+
+// The head of an event stream (X-Subscribe, /subscribe/XXX); the events follow as chunks.
+char const* const stream_head =
+    "HTTP/1.1 200 OK\r\n"
+    "%s"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "X-Connection: %d\r\n"
+    "X-Request: %lu\r\n"
+    "X-Reply: %d\r\n"
+    "\r\n";
+
+// The first header of every reply: the connection is kept alive, or closed after the reply.
+char const* const keep_alive_header = "Keep-Alive: timeout=10 max=400\r\n";
+char const* const close_header = "Connection: close\r\n";
+
+// The maximum number of seconds that a connection that is closed after a reply keeps reading
+// (and discarding) what the client still sends, before closing the socket.
+int const linger_timeout = 2;
+
+// The largest reply body that X-Size can ask for; larger values are clamped to this.
+unsigned long long const max_reply_size = 64 << 20;
+
 char const* const reading_prefix = "    < ";
 char const* const writing_prefix = "    > ";
 
+// Command line options.
+struct server_options
+{
+  int port;			// The port to listen on.
+  bool quiet;			// Suppress the per connection output.
+  bool soak;			// Run in soak mode: quiet plus periodic statistics.
+  int interval;			// Seconds between statistics reports.
+  char const* control;		// Unix socket path used for hot restarts, or NULL.
+  bool handoff_idle;		// Ask the old server to hand over its idle connections too.
+  int fastopen;			// The TCP Fast Open queue length, or 0 when TFO is not used.
+  char const* proxy;		// HOST:PORT of the backend in reverse proxy mode, or NULL.
+  int upstream_pool;		// The number of upstream connections.
+  int upstream_depth;		// The maximum number of requests in the pipeline of an upstream connection.
+  enum hol_policy_type { hol_shared, hol_pinned, hol_least_loaded } hol_policy;
+  std::vector<char const*> plugins;	// The paths of the plugins to load.
+  unsigned long bench_requests;		// Run the socketpair benchmark with this many requests, if non-zero.
+  int bench_depth;			// The pipeline depth of the socketpair benchmark.
+  bool perf_counters;			// Measure the phases with performance counters.
+  unsigned long spin_us;		// Fire sleep timers this many microseconds early and spin for the rest.
+  int lag_interval;			// Milliseconds between event loop lag probes, or 0 when not monitoring.
+  int lag_threshold;			// Print a backtrace when a probe waits longer than this many milliseconds.
+  enum engine_type { engine_asio, engine_epoll } engine;	// The connection engine (--engine).
+  enum connection_type { connection_standard, connection_minimal } connection;	// The connections of the epoll engine (--connection).
+  char const* access_log;		// The path prefix of the access log segments, or NULL.
+  std::size_t access_log_size;		// The size of an access log segment in bytes.
+  int publish;				// Milliseconds between broadcast events, or 0 when not broadcasting.
+  std::size_t event_size;		// The size of the data of a broadcast event.
+
+  server_options() : port(9001), quiet(false), soak(false), interval(10), control(NULL), handoff_idle(false), fastopen(0),
+      proxy(NULL), upstream_pool(4), upstream_depth(8), hol_policy(hol_shared),
+      bench_requests(0), bench_depth(16), perf_counters(false), spin_us(0),
+      lag_interval(0), lag_threshold(100), engine(engine_asio), connection(connection_standard), access_log(NULL), access_log_size(64 << 20),
+      publish(0), event_size(64) { }
+};
+
+server_options options;
+
+// Return a monotonic time stamp in nanoseconds.
+unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A histogram with logarithmic buckets, each power of two divided into 16 linear sub-buckets;
+// percentiles are therefore accurate to within about 6%.
+class histogram
+{
+  public:
+    histogram() { reset(); }
+    void reset() { m_count = 0; m_max = 0; m_sum = 0; m_buckets.assign(0); }
+
+    void add(unsigned long value);
+    unsigned long count() const { return m_count; }
+    unsigned long max() const { return m_max; }
+    double mean() const { return m_count ? (double)m_sum / m_count : 0.0; }
+    unsigned long percentile(double pct) const;
+
+  private:
+    static int const sub_buckets = 16;
+    static int bucket(unsigned long value);
+    static unsigned long bucket_max(int b);
+
+    unsigned long m_count;
+    unsigned long m_max;
+    unsigned long long m_sum;
+    boost::array<unsigned long, 64 * sub_buckets> m_buckets;
+};
+
+int histogram::bucket(unsigned long value)
+{
+  if (value < (unsigned long)sub_buckets)
+    return value;
+  int e = 63 - __builtin_clzl(value);		// e >= 4.
+  return (e - 3) * sub_buckets + ((value >> (e - 4)) & (sub_buckets - 1));
+}
+
+unsigned long histogram::bucket_max(int b)
+{
+  if (b < sub_buckets)
+    return b;
+  int e = b / sub_buckets + 3;
+  unsigned long lower = (unsigned long)(sub_buckets + b % sub_buckets) << (e - 4);
+  return lower + (1UL << (e - 4)) - 1;
+}
+
+void histogram::add(unsigned long value)
+{
+  ++m_buckets[bucket(value)];
+  ++m_count;
+  m_sum += value;
+  if (value > m_max)
+    m_max = value;
+}
+
+unsigned long histogram::percentile(double pct) const
+{
+  unsigned long target = std::ceil(pct / 100.0 * m_count);
+  unsigned long seen = 0;
+  for (int b = 0; b < (int)m_buckets.size(); ++b)
+    if ((seen += m_buckets[b]) >= target && seen > 0)
+      return std::min(bucket_max(b), m_max);
+  return m_max;
+}
+
+// The request controls, set by a header or by the request target.
+enum control_type
+{
+  control_sleep,		// X-Sleep, /sleep/XXX
+  control_sleep_us,		// X-Sleep-Us, /sleep-us/XXX
+  control_request,		// X-Request, /request/XXX
+  control_size,			// X-Size, /size/XXX
+  control_chunks,		// X-Chunks, /chunks/XXX
+  control_subscribe,		// X-Subscribe, /subscribe/XXX: stream XXX broadcast events (0: until the client closes).
+  number_of_routes,		// Controls below this can be used in the request target.
+  control_content_length = number_of_routes,
+  control_connection,		// Connection: close or keep-alive (not a number).
+  number_of_controls		// Controls from here on are claimed by plugins.
+};
+
+// A trie that maps a fixed set of names, inserted at startup, to small integers.
+// A lookup walks one node per character and doesn't allocate. If fold_case is
+// set, names are stored and looked up in lower case (for header names).
+class name_trie
+{
+  public:
+    static int const no_match = -1;
+
+    explicit name_trie(bool fold_case = false) : m_nodes(1), m_fold_case(fold_case) { }
+    void insert(char const* name, int value);
+    int find(char const* begin, char const* end) const;
+
+  private:
+    struct node
+    {
+      boost::array<unsigned short, 128> next;	// Index of the child node per (ASCII) character, or 0.
+      int value;
+      node() : value(no_match) { next.assign(0); }
+    };
+    std::vector<node> m_nodes;
+    bool m_fold_case;
+
+    unsigned char fold(unsigned char c) const { return m_fold_case && unsigned(c - 'A') < 26U ? c + ('a' - 'A') : c; }
+};
+
+void name_trie::insert(char const* name, int value)
+{
+  std::size_t n = 0;
+  for (; *name; ++name)
+  {
+    unsigned char c = fold(*name);
+    assert(c < 128);
+    if (!m_nodes[n].next[c])
+    {
+      m_nodes[n].next[c] = m_nodes.size();
+      m_nodes.push_back(node());
+    }
+    n = m_nodes[n].next[c];
+  }
+  m_nodes[n].value = value;
+}
+
+int name_trie::find(char const* begin, char const* end) const
+{
+  std::size_t n = 0;
+  for (char const* p = begin; p < end; ++p)
+  {
+    unsigned char c = fold(*p);
+    if (c >= 128 || !(n = m_nodes[n].next[c]))
+      return no_match;
+  }
+  return m_nodes[n].value;
+}
+
+// The header names (case-insensitive) and the path segment (or query) keys that map to controls.
+name_trie header_controls(true);
+name_trie path_controls;
+char const* const route_names[number_of_routes] = { "sleep", "sleep-us", "request", "size", "chunks", "subscribe" };
+
+// A header or target key claimed by a plugin; plugin_routes[control - number_of_controls].
+struct plugin_route
+{
+  http_server_handler handler;
+  void* user_data;
+};
+std::vector<plugin_route> plugin_routes;
+
+void init_controls()
+{
+  header_controls.insert("X-Sleep", control_sleep);
+  header_controls.insert("X-Sleep-Us", control_sleep_us);
+  header_controls.insert("X-Request", control_request);
+  header_controls.insert("X-Size", control_size);
+  header_controls.insert("X-Chunks", control_chunks);
+  header_controls.insert("X-Subscribe", control_subscribe);
+  header_controls.insert("Content-Length", control_content_length);
+  header_controls.insert("Connection", control_connection);
+  for (int route = 0; route < number_of_routes; ++route)
+    path_controls.insert(route_names[route], route);
+}
+
+// Captures the request line ("GET /path HTTP/1.1") of a request without allocating.
+class request_line
+{
+  public:
+    request_line() { reset(); }
+    void reset() { m_len = 0; m_done = false; }
+
+    operator bool() const { return m_done; }
+    void feed(char c)
+    {
+      if (m_done)
+	return;
+      if (c == '\r' || c == '\n')
+	m_done = m_len > 0;	// Ignore empty lines before the request line.
+      else if (m_len < m_buf.size())
+	m_buf[m_len++] = c;
+    }
+
+    // Return the request target in [begin, end).
+    void target(char const*& begin, char const*& end) const;
+    // Return true if this is an HTTP/1.0 request.
+    bool http10() const { return m_len >= 9 && std::memcmp(m_buf.data() + m_len - 9, " HTTP/1.0", 9) == 0; }
+
+  private:
+    // m_len and m_done first: they are used for every byte, the buffer only for the request line.
+    std::size_t m_len;
+    bool m_done;
+    boost::array<char, 512> m_buf;	// Longer lines are truncated.
+};
+
+void request_line::target(char const*& begin, char const*& end) const
+{
+  char const* const line_end = m_buf.data() + m_len;
+  begin = std::find(m_buf.data(), line_end, ' ');
+  if (begin != line_end)
+    ++begin;
+  end = std::find(begin, line_end, ' ');
+}
+
+// The phases of handling a request on a connection.
+enum phase_type
+{
+  phase_parse,		// handle_read: scanning the received bytes for headers and the end of requests.
+  phase_queue,		// queue_reply and process_replies: queueing the reply and moving it to the write queue.
+  phase_format,		// Formatting the reply.
+  phase_write,		// Starting the write and handling its completion.
+  number_of_phases
+};
+
+char const* const phase_names[number_of_phases] = { "parse", "queue", "format", "write" };
+
+// A group of performance counters of the calling thread (user space only), read with a single read(2).
+class perf_counters
+{
+  public:
+    static int const max_counters = 4;
+
+    perf_counters() : m_count(0), m_hardware(false) { }
+    ~perf_counters() { close_all(); }
+
+    // Open the hardware counters or, if that fails, the software counters. Return false if neither is available.
+    bool open();
+    bool hardware() const { return m_hardware; }
+    int count() const { return m_count; }
+    char const* name(int i) const { return m_names[i]; }
+    // Read the current value of each counter into values[0 .. count() - 1].
+    void read(unsigned long long* values) const;
+
+  private:
+    struct counter_spec
+    {
+      unsigned int type;
+      unsigned long long config;
+      char const* name;
+    };
+    static counter_spec const hardware_counters[max_counters];
+    static counter_spec const software_counters[3];
+
+    bool open(counter_spec const* specs, int count);
+    void close_all();
+
+    int m_fds[max_counters];
+    char const* m_names[max_counters];
+    int m_count;
+    bool m_hardware;
+};
+
+perf_counters::counter_spec const perf_counters::hardware_counters[max_counters] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" }
+};
+
+perf_counters::counter_spec const perf_counters::software_counters[3] = {
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock-ns" },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults" },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches" }
+};
+
+bool perf_counters::open()
+{
+  m_hardware = open(hardware_counters, max_counters);
+  return m_hardware || open(software_counters, 3);
+}
+
+bool perf_counters::open(counter_spec const* specs, int count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = specs[i].type;
+    attr.config = specs[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, m_count ? m_fds[0] : -1, 0);
+    if (fd == -1)
+    {
+      close_all();
+      return false;
+    }
+    m_fds[m_count] = fd;
+    m_names[m_count++] = specs[i].name;
+  }
+  return true;
+}
+
+void perf_counters::close_all()
+{
+  while (m_count)
+    close(m_fds[--m_count]);
+}
+
+void perf_counters::read(unsigned long long* values) const
+{
+  // With PERF_FORMAT_GROUP the leader returns the number of counters followed by their values.
+  unsigned long long buf[1 + max_counters];
+  if (::read(m_fds[0], buf, sizeof buf) < (ssize_t)((1 + m_count) * sizeof(unsigned long long)))
+    std::fill(buf + 1, buf + 1 + m_count, 0);
+  std::copy(buf + 1, buf + 1 + m_count, values);
+}
+
+// Non-NULL when --perf-counters was given and a counter group could be opened.
+perf_counters* phase_counters;
+
+// Server wide counters; everything runs in the thread of io_service.run().
+struct server_stats
+{
+  unsigned long requests;		// Requests received.
+  unsigned long replies;		// Replies written.
+  unsigned long connections;		// tcp_connection objects in existence.
+  unsigned long queued_replies;		// Reply objects in a m_reply_queue.
+  unsigned long live_replies;		// Reply objects in existence (including temporaries).
+  unsigned long armed_timers;		// Reply timers whose handler didn't run yet.
+  unsigned long long write_queue_bytes;	// Bytes of replies waiting to be written, or being written.
+  histogram latency;			// Microseconds between receiving a request and writing its reply.
+  histogram hol_delay;			// Microseconds that a ready reply waited for a sleeping or pending predecessor.
+  histogram hol_depth;			// The number of queued replies when a delayed reply was released.
+  unsigned long long hol_total;		// The sum of hol_delay, in microseconds, since the start.
+  histogram overshoot;			// Nanoseconds between the deadline of a sleeping reply and its wake up.
+  unsigned long timer_arms;		// The number of times that the timer of a Reply was armed.
+  unsigned long upstream_in_flight;	// Proxy: requests sent upstream without a response yet.
+  unsigned long upstream_waiting;	// Proxy: requests waiting for room in the pipeline of an upstream connection.
+  unsigned long upstream_errors;	// Proxy: requests that were answered with 502 Bad Gateway.
+  unsigned long route_hits[number_of_routes];	// Controls that were set by the request target.
+  unsigned long route_misses;		// Unknown keys in the request target.
+  unsigned long plugin_calls;		// Requests that were passed to a plugin.
+  unsigned long closes;			// Connections that were closed after a reply because the client asked for it.
+  unsigned long subscribers;		// Connections that stream the broadcast events.
+  unsigned long events;			// Events that were broadcast.
+  unsigned long long deliveries;	// Events that were queued on a subscriber.
+  unsigned long dropped_events;		// Events that weren't queued because the subscriber fell too far behind.
+  histogram fanout;			// Microseconds from broadcasting an event until it was queued (and written) on all subscribers.
+  unsigned long long phase_ns[number_of_phases];	// The time spent in each phase, if phase_scope::enabled.
+  unsigned long long phase_events[number_of_phases][perf_counters::max_counters];	// The counts of phase_counters per phase.
+
+  server_stats() : requests(0), replies(0), connections(0), queued_replies(0), live_replies(0), armed_timers(0), write_queue_bytes(0), hol_total(0), timer_arms(0),
+      upstream_in_flight(0), upstream_waiting(0), upstream_errors(0), route_misses(0), plugin_calls(0), closes(0),
+      subscribers(0), events(0), deliveries(0), dropped_events(0) {
+    std::fill(route_hits, route_hits + number_of_routes, 0);
+    reset_phases();
+  }
+
+  void reset_phases()
+  {
+    std::fill(phase_ns, phase_ns + number_of_phases, 0);
+    std::fill(&phase_events[0][0], &phase_events[0][0] + number_of_phases * perf_counters::max_counters, 0);
+  }
+};
+
+server_stats stats;
+
+// The system calls made by asio (and this program) that are counted. The counters are atomic
+// because other threads (the lag monitor, plugins) post handlers, which writes to an eventfd.
+struct syscall_stats
+{
+  enum type { reads, writes, epoll_waits, epoll_ctls, timer_sets, number_of_types };
+  std::atomic<unsigned long> calls[number_of_types];
+  std::atomic<unsigned long long> read_bytes;
+  std::atomic<unsigned long long> written_bytes;
+
+  syscall_stats() { reset(); }
+  void reset()
+  {
+    for (int t = 0; t < number_of_types; ++t)
+      calls[t] = 0;
+    read_bytes = 0;
+    written_bytes = 0;
+  }
+  void count(type t) { calls[t].fetch_add(1, std::memory_order_relaxed); }
+};
+
+char const* const syscall_names[syscall_stats::number_of_types] = { "read", "write", "epoll_wait", "epoll_ctl", "timerfd_settime" };
+
+syscall_stats syscalls;
+
+// The wrappers that the linker calls instead of the system calls (-Wl,--wrap=...).
+extern "C" {
+
+ssize_t __real_recv(int fd, void* buf, size_t len, int flags);
+ssize_t __real_send(int fd, void const* buf, size_t len, int flags);
+ssize_t __real_recvmsg(int fd, struct msghdr* msg, int flags);
+ssize_t __real_sendmsg(int fd, struct msghdr const* msg, int flags);
+ssize_t __real_readv(int fd, struct iovec const* iov, int iovcnt);
+ssize_t __real_writev(int fd, struct iovec const* iov, int iovcnt);
+int __real_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
+int __real_epoll_ctl(int epfd, int op, int fd, struct epoll_event* event);
+int __real_timerfd_settime(int fd, int flags, struct itimerspec const* new_value, struct itimerspec* old_value);
+
+ssize_t __wrap_recv(int fd, void* buf, size_t len, int flags)
+{
+  syscalls.count(syscall_stats::reads);
+  ssize_t bytes = __real_recv(fd, buf, len, flags);
+  if (bytes > 0)
+    syscalls.read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  return bytes;
+}
+
+ssize_t __wrap_send(int fd, void const* buf, size_t len, int flags)
+{
+  syscalls.count(syscall_stats::writes);
+  ssize_t bytes = __real_send(fd, buf, len, flags);
+  if (bytes > 0)
+    syscalls.written_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  return bytes;
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr* msg, int flags)
+{
+  syscalls.count(syscall_stats::reads);
+  ssize_t bytes = __real_recvmsg(fd, msg, flags);
+  if (bytes > 0)
+    syscalls.read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  return bytes;
+}
+
+ssize_t __wrap_sendmsg(int fd, struct msghdr const* msg, int flags)
+{
+  syscalls.count(syscall_stats::writes);
+  ssize_t bytes = __real_sendmsg(fd, msg, flags);
+  if (bytes > 0)
+    syscalls.written_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  return bytes;
+}
+
+ssize_t __wrap_readv(int fd, struct iovec const* iov, int iovcnt)
+{
+  syscalls.count(syscall_stats::reads);
+  ssize_t bytes = __real_readv(fd, iov, iovcnt);
+  if (bytes > 0)
+    syscalls.read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  return bytes;
+}
+
+ssize_t __wrap_writev(int fd, struct iovec const* iov, int iovcnt)
+{
+  syscalls.count(syscall_stats::writes);
+  ssize_t bytes = __real_writev(fd, iov, iovcnt);
+  if (bytes > 0)
+    syscalls.written_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  return bytes;
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+  syscalls.count(syscall_stats::epoll_waits);
+  return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event* event)
+{
+  syscalls.count(syscall_stats::epoll_ctls);
+  return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+int __wrap_timerfd_settime(int fd, int flags, struct itimerspec const* new_value, struct itimerspec* old_value)
+{
+  syscalls.count(syscall_stats::timer_sets);
+  return __real_timerfd_settime(fd, flags, new_value, old_value);
+}
+
+} // extern "C"
+
+// Print the system calls per request and the bytes per read and write.
+void print_syscalls(std::ostream& os, unsigned long requests)
+{
+  if (!requests)
+    return;
+  os << "syscalls per request:";
+  unsigned long total = 0;
+  for (int t = 0; t < syscall_stats::number_of_types; ++t)
+  {
+    os << ' ' << syscall_names[t] << ' ' << std::setprecision(2) << (double)syscalls.calls[t] / requests;
+    total += syscalls.calls[t];
+  }
+  os << " (total " << (double)total / requests << "); bytes per read " << std::setprecision(0) <<
+      (syscalls.calls[syscall_stats::reads] ? (double)syscalls.read_bytes / syscalls.calls[syscall_stats::reads] : 0.0) <<
+      ", per write " << (syscalls.calls[syscall_stats::writes] ? (double)syscalls.written_bytes / syscalls.calls[syscall_stats::writes] : 0.0) <<
+      "; timers armed per request " << std::setprecision(2) << (double)stats.timer_arms / requests << std::setprecision(1);
+}
+
+// Adds the time spent in its scope to stats.phase_ns[phase], and the events counted by phase_counters
+// (if any) to stats.phase_events[phase]. Scopes nest: what is spent in an inner scope is not added to
+// the outer one.
+class phase_scope
+{
+  public:
+    static bool enabled;
+
+    phase_scope(phase_type phase) : m_phase(phase)
+    {
+      if (!enabled)
+	return;
+      account();
+      ++depth;
+      m_parent = current;
+      current = m_phase;
+    }
+
+    ~phase_scope()
+    {
+      if (!enabled)
+	return;
+      account();
+      current = m_parent;
+      --depth;
+    }
+
+  private:
+    // Add everything since the previous call to the current phase, if any.
+    static void account()
+    {
+      unsigned long long now = now_ns();
+      if (depth)
+	stats.phase_ns[current] += now - last;
+      last = now;
+      if (phase_counters)
+      {
+	unsigned long long values[perf_counters::max_counters];
+	phase_counters->read(values);
+	for (int i = 0; depth && i < phase_counters->count(); ++i)
+	  stats.phase_events[current][i] += values[i] - last_values[i];
+	std::copy(values, values + phase_counters->count(), last_values);
+      }
+    }
+
+    static int depth;			// The number of nested scopes.
+    static phase_type current;		// The phase of the innermost scope.
+    static unsigned long long last;	// The time of the last call to account().
+    static unsigned long long last_values[perf_counters::max_counters];	// The counter values at the last call to account().
+    phase_type m_phase;
+    phase_type m_parent;
+};
+
+bool phase_scope::enabled;
+int phase_scope::depth;
+phase_type phase_scope::current;
+unsigned long long phase_scope::last;
+unsigned long long phase_scope::last_values[perf_counters::max_counters];
+
+// Print the time and events per request of each phase.
+void print_phases(unsigned long requests)
+{
+  if (!requests)
+    return;
+  double n = requests;
+  std::cout << std::fixed << std::setprecision(1);
+  for (int phase = 0; phase < number_of_phases; ++phase)
+  {
+    std::cout << std::setw(8) << phase_names[phase] << ": " << std::setw(8) << stats.phase_ns[phase] / n << " ns";
+    for (int i = 0; phase_counters && i < phase_counters->count(); ++i)
+      std::cout << ", " << stats.phase_events[phase][i] / n << ' ' << phase_counters->name(i);
+    if (phase_counters && phase_counters->hardware() && stats.phase_events[phase][0])
+      std::cout << ", IPC " << std::setprecision(2) << (double)stats.phase_events[phase][1] / stats.phase_events[phase][0] << std::setprecision(1);
+    std::cout << " per request" << std::endl;
+  }
+}
+
 class parser
 {
   public:
-    parser(std::string const& str) : m_str(str) { reset(); }
-    void reset() { m_match = false; m_ptr = m_str.begin(); }
+    // str must be a string literal (or otherwise outlive the parser).
+    parser(char const* str) : m_str(str) { reset(); }
+    void reset() { m_match = false; m_ptr = m_str; }
 
     operator bool() const { return m_match; }
     void feed(char c);
 
   private:
-    std::string m_str;
+    char const* m_str;
+    char const* m_ptr;
     bool m_match;
-    std::string::iterator m_ptr;
 };
 
 void parser::feed(char c)
@@ -77,7 +840,7 @@ void parser::feed(char c)
   }
   else
   {
-    m_match = ++m_ptr == m_str.end();
+    m_match = *++m_ptr == '\0';
   }
 }
 
@@ -153,210 +916,958 @@ void header::feed(char c)
     reset();
 }
 
-class tcp_connection;
-
-class Reply
+// The controls of the request that is being received, set by its headers and its target.
+// Used by both connection engines.
+struct request_controls
 {
-  public:
-    Reply(boost::asio::io_service& io_service, boost::shared_ptr<tcp_connection> const& connection, char const* s, size_t l) : m_timer(new boost::asio::deadline_timer(io_service)), m_str(s, l), m_sleep(0), m_connection(connection) { }
-    void set_sleeping(unsigned long sleep);
-    bool is_sleeping() const { return m_sleep != 0; }
-    void wakeup() { if (is_sleeping()) { m_sleep = 0; m_timer.reset(); } }
-    std::string const& str() const { return m_str; }
-    void timed_out(boost::system::error_code const& error);
+  enum connection_type { connection_default, connection_close, connection_keep_alive };
 
-  private:
-    boost::shared_ptr<boost::asio::deadline_timer> m_timer;
-    std::string m_str;
-    unsigned long m_sleep;
-    boost::shared_ptr<tcp_connection> m_connection;
+  // Part of the first two cache lines of a tcp_connection (see there), hence the 32-bit
+  // fields (large values are clamped) and the single byte ones; the plugin fields come last.
+  unsigned int sleep;				// The sleep of the request in microseconds.
+  unsigned int size;				// X-Size: the minimum size of the reply body.
+  unsigned int chunks;				// X-Chunks: the number of chunks to send the reply body in.
+  unsigned int events;				// X-Subscribe: the number of events to stream, or 0 for no limit.
+  unsigned long request;			// X-Request.
+  unsigned long long content_length;		// The value of the Content-Length header.
+  unsigned char connection;			// The Connection header, one of connection_type.
+  bool stream;					// X-Subscribe: the reply is an event stream (epoll engine only).
+  plugin_route const* plugin;			// The plugin that will produce the reply, or NULL.
+  unsigned long long plugin_value;		// The value of the header or target key that selected plugin.
+
+  request_controls() : content_length(0), connection(connection_default) { reset(); }
+  // Called once the reply was queued (content_length and connection are reset by end_of_headers).
+  void reset() { sleep = 0; request = 0; size = 0; chunks = 0; stream = false; events = 0; plugin = NULL; plugin_value = 0; }
+
+  void set(int control, unsigned long long value);
+  // Apply the header h that was just received; return its control, or name_trie::no_match.
+  int apply_header(header const& h);
+  // Apply the controls in the request target: /key/value/... path segments and/or a ?key=value&... query.
+  void route_target(request_line const& line);
+  // The empty line after the headers was received: apply the target, and return true if the
+  // connection must be closed after the reply to this request.
+  bool end_of_headers(request_line const& line);
 };
 
-void Reply::set_sleeping(unsigned long sleep)
+void request_controls::set(int control, unsigned long long value)
 {
-  if (sleep > 0)
+  switch (control)
   {
-    m_sleep = sleep;
-    m_timer->expires_from_now(boost::posix_time::millisec(m_sleep));
-    m_timer->async_wait(boost::bind(&Reply::timed_out, this, boost::asio::placeholders::error));
+    case control_sleep:
+      sleep = std::min<unsigned long long>(value, UINT_MAX / 1000) * 1000;
+      break;
+    case control_sleep_us:
+      sleep = std::min<unsigned long long>(value, UINT_MAX);
+      break;
+    case control_request:
+      request = value;
+      break;
+    case control_size:
+      size = std::min(value, max_reply_size);
+      break;
+    case control_chunks:
+      chunks = std::min<unsigned long long>(value, UINT_MAX);
+      break;
+    case control_subscribe:
+      stream = true;
+      events = std::min<unsigned long long>(value, UINT_MAX);
+      break;
+    case control_content_length:
+      content_length = value;
+      break;
+    default:
+      plugin = &plugin_routes[control - number_of_controls];
+      plugin_value = value;
+      break;
   }
-  else
+}
+
+int request_controls::apply_header(header const& h)
+{
+  std::string const& key(h.key());
+  int control = header_controls.find(key.data(), key.data() + key.size());
+  if (control == control_connection)
   {
-    wakeup();
+    char const* value = h.value().data();
+    if (strcasecmp(value, "close") == 0)
+      connection = connection_close;
+    else if (strcasecmp(value, "keep-alive") == 0)
+      connection = connection_keep_alive;
   }
+  else if (control != name_trie::no_match)
+    set(control, strtoull(h.value().data(), NULL, 10));
+  return control;
 }
 
-class tcp_connection : public boost::enable_shared_from_this<tcp_connection>
+void request_controls::route_target(request_line const& line)
 {
-public:
-    typedef boost::shared_ptr<tcp_connection> pointer;
-
-    static pointer create(boost::asio::io_service& io_service, int instance)
+  char const* p;
+  char const* end;
+  line.target(p, end);
+  bool in_query = false;
+  while (p < end)
+  {
+    if (*p == '?')
+      in_query = true;
+    if (*p == '/' || *p == '?' || *p == '&')
+    {
+      ++p;
+      continue;
+    }
+    char const* key = p;
+    while (p < end && *p != '/' && *p != '?' && *p != '&' && *p != '=')
+      ++p;
+    int route = path_controls.find(key, p);
+    bool has_value = route >= number_of_controls;	// The value is optional for plugins.
+    unsigned long long value = 0;
+    if (p < end && (*p == '=' || (*p == '/' && !in_query)))
+    {
+      for (++p; p < end && *p >= '0' && *p <= '9'; ++p)
+      {
+	value = 10 * value + (*p - '0');
+	has_value = true;
+      }
+      while (p < end && *p != '/' && *p != '?' && *p != '&')
+	++p;
+    }
+    if (route == name_trie::no_match || !has_value)
+    {
+      ++stats.route_misses;
+      continue;
+    }
+    if (route < number_of_routes)
+      ++stats.route_hits[route];
+    set(route, value);
+  }
+}
+
+bool request_controls::end_of_headers(request_line const& line)
+{
+  route_target(line);
+  bool close = connection == connection_close || (line.http10() && connection != connection_keep_alive);
+  connection = connection_default;
+  return close;
+}
+
+// Format a reply with a body of at least c.size bytes, sent in c.chunks chunks if that is non-zero.
+std::string format_sized_reply(char const* text, request_controls const& c, char const* connection, int instance, int reply)
+{
+  std::string content("<html><body>");
+  content.append(text);
+  std::size_t const natural_size = content.size() + 15;
+  if (c.size > natural_size)
+    content.append(c.size - natural_size, '.');
+  content.append("</body></html>\n");
+  char length_header[64];
+  if (c.chunks)
+    std::strcpy(length_header, "Transfer-Encoding: chunked\r\n");
+  else
+    std::snprintf(length_header, sizeof length_header, "Content-Length: %zu\r\n", content.size());
+  char head[512];
+  int size = std::snprintf(head, sizeof head, reply_head, connection, length_header, instance, c.request, reply);
+  assert(size < (int)sizeof head);
+  std::string str(head, size);
+  if (!c.chunks)
+    return str.append(content);
+  // Split the content into c.chunks (non-empty) chunks of about equal size.
+  std::size_t chunks = std::min<std::size_t>(c.chunks, content.size());
+  std::size_t pos = 0;
+  for (std::size_t i = 0; i < chunks; ++i)
+  {
+    std::size_t len = (content.size() - pos) / (chunks - i);
+    char chunk_size[32];
+    std::snprintf(chunk_size, sizeof chunk_size, "%zx\r\n", len);
+    str.append(chunk_size).append(content, pos, len).append("\r\n");
+    pos += len;
+  }
+  return str.append("0\r\n\r\n");
+}
+
+// Format reply number 'reply' on connection 'instance' to a request with controls c;
+// 'connection' is the first header (keep_alive_header or close_header).
+std::string format_reply(request_controls const& c, char const* connection, int instance, int reply)
+{
+  phase_scope scope(phase_format);
+  char body[256];
+  int size = std::snprintf(body, sizeof body, "Reply %d on connection %d for request #%lu", reply, instance, c.request);
+  assert(size < sizeof body);
+  if (c.size || c.chunks)
+    return format_sized_reply(body, c, connection, instance, reply);
+  char buf[512];
+  size = std::snprintf(buf, sizeof buf, ::reply, connection, strlen(body) + 27, instance, c.request, reply, body);
+  assert(size < sizeof buf);
+  return std::string(buf, size);
+}
+
+// The head of the reply to a subscription (the epoll engine; tcp_connection sends the normal reply).
+std::string format_stream_head(request_controls const& c, char const* connection, int instance, int reply)
+{
+  char buf[512];
+  int size = std::snprintf(buf, sizeof buf, stream_head, connection, instance, c.request, reply);
+  assert(size < (int)sizeof buf);
+  return std::string(buf, size);
+}
+
+// Head-of-line blocking: add the time that a reply, that was ready at 'ready', waited for
+// the replies before it, with 'depth' replies still queued after it. Returns the delay in
+// microseconds, or 0 if the reply wasn't delayed.
+unsigned long account_hol_delay(unsigned long long ready, std::size_t depth)
+{
+  // Normally (no predecessor was blocking) a reply is released in the same call that made it ready.
+  unsigned long long now = now_ns();
+  if (now - ready < 1000)
+    return 0;
+  unsigned long delay = (now - ready) / 1000;
+  stats.hol_delay.add(delay);
+  stats.hol_depth.add(depth);
+  stats.hol_total += delay;
+  return delay;
+}
+
+// The binary access log (--access-log). Every thread appends to its own segments, that are
+// created (and faulted in) in advance, so that a record costs a few stores and no system call.
+// A helper thread prepares the next segment while the current one fills up, and closes the
+// previous one, so that a rotation only swaps mappings.
+class access_log
+{
+  public:
+    // The access log of the calling thread, created on first use.
+    static access_log& thread_log();
+    ~access_log();
+
+    void append(access_record const& record)
+    {
+      if (m_header->records == m_capacity)
+	next_segment();
+      m_records[m_header->records] = record;
+      // Readers only look at the records that the header counts.
+      ++m_header->records;
+    }
+
+  private:
+    // A mapped segment file.
+    struct segment
+    {
+      access_log_header* header;	// The mapping, or NULL.
+      std::string path;
+      segment() : header(NULL) { }
+    };
+
+    access_log();
+    void next_segment();
+    // Create, map and fault in segment number n.
+    segment prepare(int n) const;
+    // Unmap s and truncate its file to the records that it holds.
+    static void close_segment(segment& s);
+    static void* preparer_main(void* self) { static_cast<access_log*>(self)->run_preparer(); return NULL; }
+    void run_preparer();
+    void wait_for_preparer();
+
+    access_log_header* m_header;	// The mapping of the current segment.
+    access_record* m_records;		// The records, right after the header.
+    uint64_t m_capacity;		// The number of records that fit in a segment.
+    int m_segment;			// The number of the current segment.
+    pid_t m_tid;
+    segment m_current;
+    segment m_next;			// Prepared by the helper thread; empty if that failed.
+    segment m_retired;			// The previous segment, closed by the helper thread.
+    pthread_t m_preparer;
+    bool m_preparing;			// m_preparer was started and not joined yet.
+};
+
+access_log& access_log::thread_log()
+{
+  static thread_local boost::scoped_ptr<access_log> log;
+  if (!log)
+    log.reset(new access_log);
+  return *log;
+}
+
+access_log::access_log() : m_header(NULL), m_records(NULL), m_capacity(0), m_segment(-1), m_tid(syscall(SYS_gettid)), m_preparing(false)
+{
+  m_next = prepare(0);
+  next_segment();
+}
+
+access_log::~access_log()
+{
+  wait_for_preparer();
+  close_segment(m_current);
+  // The prepared segment was never used.
+  if (m_next.header)
+  {
+    munmap(m_next.header, options.access_log_size);
+    unlink(m_next.path.c_str());
+  }
+}
+
+access_log::segment access_log::prepare(int n) const
+{
+  segment s;
+  char path[PATH_MAX];
+  std::snprintf(path, sizeof path, "%s.%d.%d", options.access_log, (int)m_tid, n);
+  s.path = path;
+  std::size_t size = options.access_log_size;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    throw std::runtime_error(s.path + ": " + std::strerror(errno));
+  // Allocate the blocks now, so that writing to the mapping doesn't have to.
+  int error = posix_fallocate(fd, 0, size);
+  if (error)
+  {
+    close(fd);
+    throw std::runtime_error(s.path + ": " + std::strerror(error));
+  }
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error(s.path + ": mmap: " + std::strerror(errno));
+  // MAP_POPULATE maps the pages read-only; the first write to each would still fault.
+  std::memset(mapping, 0, size);
+  s.header = static_cast<access_log_header*>(mapping);
+  std::memcpy(s.header->magic, ACCESS_LOG_MAGIC, sizeof s.header->magic);
+  s.header->version = ACCESS_LOG_VERSION;
+  s.header->record_size = sizeof(access_record);
+  s.header->pid = getpid();
+  s.header->tid = m_tid;
+  s.header->segment = n;
+  s.header->records = 0;
+  return s;
+}
+
+void access_log::close_segment(segment& s)
+{
+  if (!s.header)
+    return;
+  off_t used = sizeof(access_log_header) + s.header->records * sizeof(access_record);
+  munmap(s.header, options.access_log_size);
+  s.header = NULL;
+  if (truncate(s.path.c_str(), used) == -1)
+    std::cerr << s.path << ": " << std::strerror(errno) << std::endl;
+}
+
+// The helper thread: close the previous segment and prepare the one after the current one.
+void access_log::run_preparer()
+{
+  close_segment(m_retired);
+  try
+  {
+    m_next = prepare(m_segment + 1);
+  }
+  catch (std::exception&)
+  {
+    // next_segment tries again, and reports the error.
+  }
+}
+
+void access_log::wait_for_preparer()
+{
+  if (!m_preparing)
+    return;
+  pthread_join(m_preparer, NULL);
+  m_preparing = false;
+}
+
+// Rotate: continue in the prepared segment and start preparing the next one.
+void access_log::next_segment()
+{
+  wait_for_preparer();
+  if (!m_next.header)
+    m_next = prepare(m_segment + 1);
+  m_retired = m_current;
+  m_current = m_next;
+  m_next = segment();
+  ++m_segment;
+  m_header = m_current.header;
+  m_records = reinterpret_cast<access_record*>(m_header + 1);
+  m_capacity = (options.access_log_size - sizeof(access_log_header)) / sizeof(access_record);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  m_header->start_sec = ts.tv_sec;
+  m_header->start_nsec = ts.tv_nsec;
+  m_header->start_ns = now_ns();
+  if (pthread_create(&m_preparer, NULL, &access_log::preparer_main, this) == 0)
+    m_preparing = true;
+  else
+    close_segment(m_retired);	// The next rotation prepares its segment itself.
+}
+
+// Record a reply that is released for writing in the access log of the calling thread, if --access-log was given.
+void log_reply(int connection, int reply, unsigned long request, std::string const& data,
+    unsigned long long received, unsigned long long ready, unsigned long sleep, unsigned long hol)
+{
+  if (!options.access_log)
+    return;
+  access_record record;
+  std::memset(&record, 0, sizeof record);
+  record.received_ns = received;
+  record.ready_ns = ready;
+  record.sent_ns = now_ns();
+  record.request = request;
+  record.connection = connection;
+  record.reply = reply;
+  record.bytes = data.size();
+  record.sleep_us = sleep;
+  record.hol_us = hol;
+  // "HTTP/1.1 200 OK"
+  if (data.size() > 12 && std::isdigit((unsigned char)data[9]) && std::isdigit((unsigned char)data[10]) && std::isdigit((unsigned char)data[11]))
+    record.status = (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+  access_log::thread_log().append(record);
+}
+
+// A free list allocator for objects of 'size' bytes that are created and destroyed often
+// (connections and their receive buffers). Memory is taken from the system a slab of
+// objects at a time, aligned to a cache line, and is never returned. Only used by the
+// io_service thread.
+template<std::size_t size>
+class slab_allocator
+{
+  public:
+    static void* allocate();
+    static void deallocate(void* ptr);
+    // The number of objects that are currently allocated.
+    static std::size_t in_use() { return s_in_use; }
+
+  private:
+    static std::size_t const cache_line = 64;
+    static std::size_t const block_size = (size + cache_line - 1) / cache_line * cache_line;
+    static std::size_t const blocks_per_slab = block_size < 65536 ? 65536 / block_size : 1;
+    struct free_block { free_block* next; };
+    static free_block* s_free;
+    static std::size_t s_in_use;
+};
+
+template<std::size_t size>
+typename slab_allocator<size>::free_block* slab_allocator<size>::s_free;
+
+template<std::size_t size>
+std::size_t slab_allocator<size>::s_in_use;
+
+template<std::size_t size>
+void* slab_allocator<size>::allocate()
+{
+  if (!s_free)
+  {
+    char* slab = static_cast<char*>(aligned_alloc(cache_line, blocks_per_slab * block_size));
+    if (!slab)
+      throw std::bad_alloc();
+    for (std::size_t i = blocks_per_slab; i > 0; --i)
+    {
+      free_block* block = reinterpret_cast<free_block*>(slab + (i - 1) * block_size);
+      block->next = s_free;
+      s_free = block;
+    }
+  }
+  free_block* block = s_free;
+  s_free = block->next;
+  ++s_in_use;
+  return block;
+}
+
+template<std::size_t size>
+void slab_allocator<size>::deallocate(void* ptr)
+{
+  if (!ptr)
+    return;
+  free_block* block = static_cast<free_block*>(ptr);
+  block->next = s_free;
+  s_free = block;
+  --s_in_use;
+}
+
+// The buffer that a connection reads into.
+typedef boost::array<char, 8192> receive_buffer;
+
+class tcp_connection;
+class hot_restart;
+class upstream_pool;
+
+// The connections that were started and are not destroyed yet.
+std::set<tcp_connection*> live_connections;
+// Non-NULL when --control was given.
+hot_restart* restarter;
+// Non-NULL when --proxy was given.
+upstream_pool* proxy;
+
+class Reply
+{
+  public:
+    Reply(boost::asio::io_service& io_service, boost::shared_ptr<tcp_connection> const& connection, char const* s, size_t l) : m_timer(new boost::asio::steady_timer(io_service)), m_str(s, l), m_sleep(0), m_pending(0), m_number(0), m_request(0), m_requested_sleep(0), m_received(now_ns()), m_ready(m_received), m_deadline(0), m_connection(connection) { ++stats.live_replies; }
+    Reply(Reply const& r) : m_timer(r.m_timer), m_str(r.m_str), m_sleep(r.m_sleep), m_pending(r.m_pending), m_number(r.m_number), m_request(r.m_request), m_requested_sleep(r.m_requested_sleep), m_received(r.m_received), m_ready(r.m_ready), m_deadline(r.m_deadline), m_connection(r.m_connection) { ++stats.live_replies; }
+    ~Reply() { --stats.live_replies; }
+    // Sleep until 'sleep' microseconds after the request was received.
+    void set_sleeping(unsigned long sleep);
+    bool is_sleeping() const { return m_sleep != 0; }
+    void wakeup() { if (is_sleeping()) { m_sleep = 0; m_timer.reset(); m_ready = now_ns(); } }
+    std::string const& str() const { return m_str; }
+    void take_str(std::string& str) { str.swap(m_str); }
+    // A pending reply is produced elsewhere (by the upstream server in proxy mode); 'reply' is its X-Reply number.
+    void set_pending(int reply) { m_pending = reply; }
+    int pending() const { return m_pending; }
+    // For the access log: the X-Reply and X-Request numbers and the requested sleep (microseconds).
+    void identify(int number, unsigned long request, unsigned long sleep) { m_number = number; m_request = request; m_requested_sleep = sleep; }
+    int number() const { return m_number; }
+    unsigned long request() const { return m_request; }
+    unsigned long requested_sleep() const { return m_requested_sleep; }
+    void complete(std::string& str) { m_pending = 0; str.swap(m_str); m_ready = now_ns(); }
+    unsigned long long received() const { return m_received; }
+    // The time at which the reply could have been written, if it weren't for the replies before it.
+    unsigned long long ready() const { return m_ready; }
+    void timed_out(boost::system::error_code const& error);
+
+  private:
+    boost::shared_ptr<boost::asio::steady_timer> m_timer;
+    std::string m_str;
+    unsigned long m_sleep;		// Microseconds.
+    int m_pending;			// The X-Reply number while the reply is pending, otherwise 0.
+    int m_number;			// X-Reply.
+    unsigned long m_request;		// X-Request.
+    unsigned long m_requested_sleep;	// Microseconds; m_sleep is reset when the reply wakes up.
+    unsigned long long m_received;	// now_ns() at the moment the request was received.
+    unsigned long long m_ready;		// now_ns() at the moment the reply was complete and not sleeping anymore.
+    unsigned long long m_deadline;	// now_ns() at which a sleeping reply must wake up.
+    boost::shared_ptr<tcp_connection> m_connection;
+};
+
+void Reply::set_sleeping(unsigned long sleep)
+{
+  if (sleep > 0)
+  {
+    m_sleep = sleep;
+    // now_ns() and the steady clock both use CLOCK_MONOTONIC.
+    m_deadline = m_received + 1000ULL * m_sleep;
+    unsigned long long early = 1000ULL * std::min(options.spin_us, m_sleep);
+    std::chrono::nanoseconds deadline(m_deadline - early);
+    m_timer->expires_at(boost::asio::steady_timer::time_point(std::chrono::duration_cast<boost::asio::steady_timer::duration>(deadline)));
+    m_timer->async_wait(boost::bind(&Reply::timed_out, this, boost::asio::placeholders::error));
+    ++stats.armed_timers;
+    ++stats.timer_arms;
+  }
+  else
+  {
+    wakeup();
+  }
+}
+
+class tcp_connection : public boost::enable_shared_from_this<tcp_connection>
+{
+public:
+    typedef boost::shared_ptr<tcp_connection> pointer;
+
+    static pointer create(boost::asio::io_service& io_service, int instance)
     {
       return pointer(new tcp_connection(io_service, instance));
     }
 
+    // Connections are allocated from a slab, aligned to a cache line (see the layout of the members).
+    static void* operator new(std::size_t) { return slab_allocator<sizeof(tcp_connection)>::allocate(); }
+    static void operator delete(void* ptr) { slab_allocator<sizeof(tcp_connection)>::deallocate(ptr); }
+
     tcp::socket& socket()
     {
       return m_socket;
     }
 
+    ~tcp_connection();
+
     void start()
     {
-      std::cout << prefix() << "Accepted a new client." << std::endl;
-      m_socket.async_read_some(boost::asio::buffer(m_buffer),
-          boost::bind(&tcp_connection::handle_read, shared_from_this(),
-	    boost::asio::placeholders::error,
-	    boost::asio::placeholders::bytes_transferred));
+      if (!options.quiet)
+	std::cout << prefix() << "Accepted a new client." << std::endl;
+      live_connections.insert(this);
+      start_read();
+    }
+
+    int instance() const { return m_instance; }
+    int reply_count() const { return m_reply; }
+    // Used when a connection is taken over from another process: continue the X-Reply numbering.
+    void set_reply_count(int reply) { m_reply = reply; }
+
+    // Stop reading new requests and, once every request that was read is answered,
+    // hand the connection over to the new process (or close it).
+    void drain()
+    {
+      m_draining = true;
+      continue_drain();
     }
 
   private:
     tcp_connection(boost::asio::io_service& io_service, int instance) :
-      m_instance(instance), m_reply(0), m_closed(false), m_socket(io_service), m_eom("\r\n\r\n"), m_sleep(0), m_request(0) { }
+      m_eom("\r\n\r\n"), m_line_length(0), m_body_left(0), m_reply(0), m_close_after(0),
+      m_at_boundary(true), m_reading(false), m_request_line_seen(false), m_draining(false), m_peer_closed(false),
+      m_instance(instance), m_closed(false), m_socket(io_service), m_buffer(new (slab_allocator<sizeof(receive_buffer)>::allocate()) receive_buffer),
+      m_raw_begin(NULL), m_raw_end(NULL), m_linger_timer(io_service), m_hol_total(0), m_hol_count(0), m_hol_max(0) { ++stats.connections; }
+
+    void start_read()
+    {
+      m_reading = true;
+      m_socket.async_read_some(boost::asio::buffer(*m_buffer),
+	  boost::bind(&tcp_connection::handle_read, shared_from_this(),
+	    boost::asio::placeholders::error,
+	    boost::asio::placeholders::bytes_transferred));
+    }
+
+    void continue_drain();
 
     void handle_read(const boost::system::error_code& e, std::size_t bytes_transferred)
     {
-      if (!e)
+      phase_scope scope(phase_parse);
+      m_reading = false;
+      if (!e && last_request_queued())
+      {
+	// Lingering close: discard everything after the last request until the client closes the connection.
+	start_read();
+      }
+      else if (!e)
       {
-	std::cout << prefix() << "Read " << bytes_transferred << " bytes:" << std::endl;
+	if (!options.quiet)
+	  std::cout << prefix() << "Read " << bytes_transferred << " bytes:" << std::endl;
 
 	bool new_message = true;
-	for (char const* p = m_buffer.data(); p < m_buffer.data() + bytes_transferred; ++p)
+	char const* const end = m_buffer->data() + bytes_transferred;
+	m_raw_begin = m_buffer->data();
+	for (char const* p = m_buffer->data(); p < end; ++p)
 	{
-	  if (new_message)
+	  if (m_body_left)
 	  {
-	    std::cout << reading_prefix;
-	    new_message = false;
+	    // Skip (the remainder of) the request body without echoing it byte for byte.
+	    std::size_t len = std::min<std::size_t>(m_body_left, end - p);
+	    if (!options.quiet)
+	      std::cout << reading_prefix << "<" << len << " bytes of body>" << std::endl;
+	    m_body_left -= len;
+	    p += len - 1;
+	    if (!m_body_left)
+	    {
+	      m_raw_end = p + 1;
+	      queue_reply();
+	      end_of_request();
+	      if (last_request_queued())
+		break;
+	    }
+	    continue;
 	  }
+	  m_at_boundary = false;
 	  m_eom.feed(*p);
 	  m_header.feed(*p);
-	  if (*p == '\n')
+	  m_request_line.feed(*p);
+	  ++m_line_length;
+	  if (!options.quiet)
 	  {
-	    std::cout << "\\n" << std::endl;
-	    if (!m_eom)
+	    if (new_message)
 	    {
 	      std::cout << reading_prefix;
+	      new_message = false;
+	    }
+	    if (*p == '\n')
+	    {
+	      std::cout << "\\n" << std::endl;
+	      if (!m_eom)
+	      {
+		std::cout << reading_prefix;
+	      }
+	      else
+	      {
+		new_message = true;
+	      }
+	    }
+	    else if (*p == '\r')
+	    {
+	      std::cout << "\\r";
 	    }
 	    else
 	    {
-	      new_message = true;
+	      std::cout << *p;
 	    }
 	  }
-	  else if (*p == '\r')
+	  if (*p == '\n' && options.proxy && m_request_line && !m_request_line_seen)
 	  {
-	    std::cout << "\\r";
-	  }
-	  else
-	  {
-	    std::cout << *p;
+	    // Connection is a hop-by-hop header: the upstream connection must stay open.
+	    m_request_line_seen = true;
+	    if (m_request_line.http10())
+	      edit_raw_request(p, 0, "Connection: keep-alive\r\n");
 	  }
+	  if (*p == '\n')
+	    m_line_length = 0;
           if (m_eom)
 	  {
 	    m_eom.reset();
 	    m_header.reset();
-	    // Send reply every time we received the sequence "\r\n\r\n".
-	    queue_reply();
-	    m_sleep = 0;
-	  }
-	  else if (m_header)
-	  {
-	    if (m_header.key() == "X-Sleep")
-	      m_sleep = strtoul(m_header.value().data(), NULL, 10);
-	    else if (m_header.key() == "X-Request")
-	      m_request = strtoul(m_header.value().data(), NULL, 10);
+	    if (m_controls.end_of_headers(m_request_line))
+	      m_close_after = m_reply + 1;	// The reply to this request is the last one.
+	    // Send reply every time we received the sequence "\r\n\r\n",
+	    // or - if the request has a body - once the whole body was received.
+	    m_body_left = m_controls.content_length;
+	    m_controls.content_length = 0;
+	    if (!m_body_left)
+	    {
+	      m_raw_end = p + 1;
+	      queue_reply();
+	      end_of_request();
+	      if (last_request_queued())
+		break;		// Discard anything that was pipelined after the last request.
+	    }
 	  }
+	  else if (m_header && m_controls.apply_header(m_header) == control_connection && options.proxy)
+	    edit_raw_request(p, m_line_length, "");	// Connection is a hop-by-hop header.
 	}
 
-	// Always receive more data (we're pipelining).
-	m_socket.async_read_some(boost::asio::buffer(m_buffer),
-	    boost::bind(&tcp_connection::handle_read, shared_from_this(),
-	      boost::asio::placeholders::error,
-	      boost::asio::placeholders::bytes_transferred));
+	// Keep the start of a request that is only partially received.
+	if (options.proxy && !last_request_queued())
+	  m_raw_request.append(m_raw_begin, end);
+
+	// Always receive more data (we're pipelining); unless we're draining.
+	if (m_draining)
+	  continue_drain();
+	else
+	  start_read();
+      }
+      else if (e == boost::asio::error::operation_aborted)
+      {
+	if (m_draining)
+	  continue_drain();
+      }
+      else if (e == boost::asio::error::eof && (!m_reply_queue.empty() || !m_write_queue.empty()))
+      {
+	// The client half-closed the connection after pipelining requests: still send the (sleeping) replies.
+	if (!options.quiet)
+	  std::cout << prefix() << "The client closed the connection; closing it after the queued replies." << std::endl;
+	m_peer_closed = true;
       }
-      else if (e != boost::asio::error::operation_aborted)
+      else
       {
-	std::cout << prefix() << "Error " << e << ". Closing connection." << std::endl;
+	if (!options.quiet)
+	  std::cout << prefix() << "Error " << e << ". Closing connection." << std::endl;
+	stats.queued_replies -= m_reply_queue.size();
 	m_reply_queue.clear();
 	m_socket.close();
 	m_closed = true;
+	m_linger_timer.cancel();
       }
     }
 
+    void end_of_request()
+    {
+      m_request_line.reset();
+      m_request_line_seen = false;
+      m_at_boundary = true;
+    }
+
+    // Proxy mode: replace the last 'length' bytes up till and including p of the request with 'replacement'.
+    void edit_raw_request(char const* p, std::size_t length, char const* replacement)
+    {
+      m_raw_request.append(m_raw_begin, p + 1);
+      m_raw_begin = p + 1;
+      m_raw_request.replace(m_raw_request.size() - length, length, replacement);
+    }
+
+    // Return true if the request after which the connection must be closed was read and queued.
+    bool last_request_queued() const { return m_close_after && m_reply >= m_close_after; }
+
+    // The first header of reply number 'reply'.
+    char const* connection_header(int reply) const
+    {
+      return reply == m_close_after ? close_header : keep_alive_header;
+    }
+
+    // The last reply was written: shut down the sending side and close the socket once the client closed its side.
+    void lingering_close()
+    {
+      ++stats.closes;
+      boost::system::error_code ec;
+      m_socket.shutdown(tcp::socket::shutdown_send, ec);
+      m_linger_timer.expires_from_now(boost::posix_time::seconds(linger_timeout));
+      m_linger_timer.async_wait(boost::bind(&tcp_connection::linger_timed_out, shared_from_this(), boost::asio::placeholders::error));
+    }
+
+    void linger_timed_out(boost::system::error_code const& error)
+    {
+      if (error || m_closed)
+	return;
+      if (!options.quiet)
+	std::cout << prefix() << "The client didn't close the connection; closing it." << std::endl;
+      m_socket.close();
+      m_closed = true;
+    }
+
     void handle_write(const boost::system::error_code& e, size_t bytes_transferred)
     {
+      phase_scope scope(phase_write);
       if (!e)
-	std::cout << prefix() << "Wrote " << bytes_transferred << " bytes." << std::endl;
-      else
+      {
+	if (!options.quiet)
+	  std::cout << prefix() << "Wrote " << bytes_transferred << " bytes." << std::endl;
+	++stats.replies;
+	stats.latency.add((now_ns() - m_write_queue.front().received) / 1000);
+      }
+      else if (!options.quiet)
 	std::cout << prefix() << "Error " << e << " writing data." << std::endl;
+      stats.write_queue_bytes -= m_write_queue.front().data.size();
+      m_write_queue.pop_front();
+      // Start writing the next reply, if any.
+      if (!m_write_queue.empty() && !e)
+	start_write();
+      else
+      {
+	for (std::deque<outgoing>::iterator o = m_write_queue.begin(); o != m_write_queue.end(); ++o)
+	  stats.write_queue_bytes -= o->data.size();
+	m_write_queue.clear();
+	if (m_peer_closed && (m_reply_queue.empty() || e))
+	{
+	  stats.queued_replies -= m_reply_queue.size();
+	  m_reply_queue.clear();
+	  m_socket.close();
+	  m_closed = true;
+	  m_linger_timer.cancel();
+	}
+	else if (last_request_queued() && m_reply_queue.empty() && !e)
+	  lingering_close();
+	else if (m_draining)
+	  continue_drain();
+      }
+    }
+
+    // Write the reply at the front of m_write_queue. Only one async_write may be in progress at
+    // a time, and the string must stay alive until it finished, hence the queue.
+    void start_write()
+    {
+      phase_scope scope(phase_write);
+      boost::asio::async_write(m_socket, boost::asio::buffer(m_write_queue.front().data),
+	  boost::bind(&tcp_connection::handle_write, shared_from_this(),
+	    boost::asio::placeholders::error,
+	    boost::asio::placeholders::bytes_transferred));
     }
 
+    void forward_request();
+    void call_plugin();
+
     void queue_reply()
     {
-      char body[256];
-      int size = std::snprintf(body, sizeof body, "Reply %d on connection %d for request #%lu", ++m_reply, m_instance, m_request);
-      assert(size < sizeof body);
-      char buf[512];
-      size = std::snprintf(buf, sizeof buf, reply, strlen(body) + 27, m_instance, m_request, m_reply, body);
-      assert(size < sizeof buf);
-      m_request = 0;
-      std::string reply_formatted(buf, size);
-      m_reply_queue.push_back(Reply(GET_IO_SERVICE(m_socket), shared_from_this(), buf, size));
-      if (m_sleep)
+      phase_scope scope(phase_queue);
+      if (m_controls.plugin)
+      {
+	call_plugin();
+	return;
+      }
+      if (options.proxy)
+      {
+	forward_request();
+	return;
+      }
+      ++stats.requests;
+      m_reply_queue.push_back(Reply(GET_IO_SERVICE(m_socket), shared_from_this(), "", 0));
+      ++m_reply;
+      std::string str(format_reply(m_controls, connection_header(m_reply), m_instance, m_reply));
+      m_reply_queue.back().complete(str);
+      m_reply_queue.back().identify(m_reply, m_controls.request, m_controls.sleep);
+      ++stats.queued_replies;
+      if (m_controls.sleep)
       {
 	Reply* rp = &m_reply_queue.back();
-	rp->set_sleeping(m_sleep);
+	rp->set_sleeping(m_controls.sleep);
       }
+      m_controls.reset();
       process_replies();
     }
 
   public:
     void process_replies()
     {
+      phase_scope scope(phase_queue);
       if (m_closed)
 	return;
       if (m_reply_queue.empty())
       {
-	std::cout << prefix() << "process_replies(): nothing to write." << std::endl;
+	if (!options.quiet)
+	  std::cout << prefix() << "process_replies(): nothing to write." << std::endl;
 	return;
       }
       while (!m_reply_queue.empty())
       {
 	Reply& r = m_reply_queue.front();
-	if (r.is_sleeping())
+	if (r.is_sleeping() || r.pending())
 	{
 	  return;
 	}
-	std::cout << prefix() << "process_replies(): writing data:" << std::endl;
-	bool new_line = true;
-	for (std::string::const_iterator p = r.str().begin(); p < r.str().end(); ++p)
+	if (!options.quiet)
 	{
-	  if (new_line)
-	  {
-	    std::cout << writing_prefix;
-	    new_line = false;
-	  }
-	  if (*p == '\r')
-	  {
-	    std::cout << "\\r";
-	  }
-	  else if (*p == '\n')
-	  {
-	    std::cout << "\\n" << std::endl;
-	    new_line = true;
-	  }
-	  else
+	  std::cout << prefix() << "process_replies(): writing data:" << std::endl;
+	  bool new_line = true;
+	  for (std::string::const_iterator p = r.str().begin(); p < r.str().end(); ++p)
 	  {
-	    std::cout << *p;
+	    if (new_line)
+	    {
+	      std::cout << writing_prefix;
+	      new_line = false;
+	    }
+	    if (*p == '\r')
+	    {
+	      std::cout << "\\r";
+	    }
+	    else if (*p == '\n')
+	    {
+	      std::cout << "\\n" << std::endl;
+	      new_line = true;
+	    }
+	    else
+	    {
+	      std::cout << *p;
+	    }
 	  }
 	}
-	boost::asio::async_write(m_socket, boost::asio::buffer(r.str()),
-	    boost::bind(&tcp_connection::handle_write, shared_from_this(),
-	      boost::asio::placeholders::error,
-	      boost::asio::placeholders::bytes_transferred));
+	unsigned long hol = account_hol(r);
+	log_reply(m_instance, r.number(), r.request(), r.str(), r.received(), r.ready(), r.requested_sleep(), hol);
+	m_write_queue.push_back(outgoing(r.received()));
+	r.take_str(m_write_queue.back().data);
+	stats.write_queue_bytes += m_write_queue.back().data.size();
 	m_reply_queue.pop_front();
+	--stats.queued_replies;
+	if (m_write_queue.size() == 1)
+	  start_write();
       }
     }
 
+  private:
+    // Head-of-line blocking: add the time that r waited for the replies before it since it was ready.
+    // Returns the delay in microseconds.
+    unsigned long account_hol(Reply const& r)
+    {
+      unsigned long delay = account_hol_delay(r.ready(), m_reply_queue.size());
+      if (!delay)
+	return 0;
+      m_hol_total += delay;
+      ++m_hol_count;
+      if (delay > m_hol_max)
+	m_hol_max = delay;
+      return delay;
+    }
+
+  public:
+    unsigned long long hol_total() const { return m_hol_total; }
+    // Print the HOL blocking delay of this connection.
+    void print_hol(std::ostream& os) const
+    {
+      os << "#" << m_instance << ": " << m_hol_count << " of " << m_reply << " replies delayed by HOL blocking, total " <<
+	  m_hol_total << " us, max " << m_hol_max << " us";
+    }
+
+    // The reply for pending reply 'reply' was produced (by the upstream server or a plugin). Complete it with 'head' (the
+    // status line and the headers without the terminating empty line) and 'body'.
+    void complete_reply(int reply, std::string const& head, std::string const& body)
+    {
+      for (std::deque<Reply>::iterator r = m_reply_queue.begin(); r != m_reply_queue.end(); ++r)
+	if (r->pending() == reply)
+	{
+	  char buf[96];
+	  std::snprintf(buf, sizeof buf, "%sX-Connection: %d\r\nX-Reply: %d\r\n\r\n", connection_header(reply), m_instance, reply);
+	  std::string str;
+	  str.reserve(head.size() + std::strlen(buf) + body.size());
+	  str.append(head).append(buf).append(body);
+	  r->complete(str);
+	  process_replies();
+	  return;
+	}
+    }
+
     std::string prefix() const
     {
       struct timeval tv;
@@ -373,38 +1884,528 @@ public:
     }
 
   private:
-    int m_instance;
-    int m_reply;
-    bool m_closed;
-    tcp::socket m_socket;
-    boost::array<char, 8192> m_buffer;
+    // The members are ordered by how often they are used. The object is allocated on a cache
+    // line boundary. The first cache line holds (after the 16 bytes of enable_shared_from_this)
+    // the scalars that are used for every byte, the second one the controls of the current
+    // request (56 bytes) followed by the flags. The header parser and the queues start on the
+    // third cache line. Everything that is only used per connection (or in proxy mode) comes
+    // last, and the receive buffer is allocated separately.
+
+    // Used for every byte.
     parser m_eom;
+    std::size_t m_line_length;			// The number of bytes of the current line received so far.
+    unsigned long long m_body_left;		// The number of request body bytes that still have to be skipped.
+    // Used for every request.
+    int m_reply;
+    int m_close_after;				// The X-Reply number of the last reply before closing, or 0.
+    request_controls m_controls;		// The controls of the current request.
+    bool m_at_boundary;				// Set when the last byte read was the end of a request.
+    bool m_reading;				// Set while an async_read_some is pending.
+    bool m_request_line_seen;			// Proxy mode: the request line of the current request was received.
+    bool m_draining;				// Set after drain() was called.
+    bool m_peer_closed;				// The client closed its side; close once the queued replies were written.
+
     header m_header;
-    unsigned long m_sleep;
-    unsigned long m_request;
     std::deque<Reply> m_reply_queue;
+
+    // A reply that was taken from m_reply_queue and is waiting to be written, or is being written.
+    struct outgoing
+    {
+      std::string data;
+      unsigned long long received;		// Reply::received().
+      outgoing(unsigned long long r) : received(r) { }
+    };
+    std::deque<outgoing> m_write_queue;
+    request_line m_request_line;
+
+    // Used per connection.
+    int m_instance;
+    bool m_closed;
+    tcp::socket m_socket;
+    receive_buffer* m_buffer;			// Allocated from a slab, like the connection itself.
+    // Proxy mode: the raw bytes of the request that is being received.
+    std::string m_raw_request;
+    char const* m_raw_begin;			// The start of the current request in m_buffer (or m_buffer->data()).
+    char const* m_raw_end;			// One past the end of the request that is being queued.
+    boost::asio::deadline_timer m_linger_timer;	// Closes the connection linger_timeout seconds after lingering_close().
+    unsigned long long m_hol_total;		// The total HOL blocking delay of the replies on this connection, in microseconds.
+    unsigned long m_hol_count;			// The number of replies that were delayed by HOL blocking.
+    unsigned long m_hol_max;			// The longest HOL blocking delay, in microseconds.
 };
 
 void Reply::timed_out(boost::system::error_code const& error)
 {
+  --stats.armed_timers;
   if (!error)
   {
+    unsigned long long now = now_ns();
+    if (options.spin_us)
+      while (now < m_deadline)
+	now = now_ns();
+    stats.overshoot.add(now > m_deadline ? now - m_deadline : 0);
     m_sleep = 0;		// Not sleeping anymore.
-    m_connection->process_replies();
+    m_ready = now;
+    // process_replies() destroys this Reply, while m_connection might be the last reference to the connection.
+    boost::shared_ptr<tcp_connection> connection(m_connection);
+    connection->process_replies();
   }
 }
 
-class tcp_server
+// Proxy mode: a request that is forwarded to the backend.
+struct proxy_request
+{
+  boost::weak_ptr<tcp_connection> client;
+  int reply;			// The X-Reply number that the client connection assigned to it.
+  std::string data;		// The raw request.
+};
+
+// Proxy mode: a pipelined connection to the backend.
+class upstream_connection
 {
   public:
-    tcp_server(boost::asio::io_service& io_service) : m_acceptor(io_service, tcp::endpoint(tcp::v4(), 9001)), m_count(0)
-    {
-      std::cout << "Listening on port 9001..." << std::endl;
-      m_acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    upstream_connection(boost::asio::io_service& io_service, int id, tcp::endpoint const& backend) :
+	m_id(id), m_backend(backend), m_socket(io_service), m_timer(io_service), m_connected(false), m_writing(false) { connect(); }
+
+    // The number of requests that were dispatched to this connection and are not answered yet.
+    std::size_t load() const { return m_in_flight.size() + m_waiting.size(); }
+    // Queue request (its data is taken) and send it as soon as the pipeline has room.
+    void send(proxy_request& request);
+
+  private:
+    void connect();
+    void handle_connect(boost::system::error_code const& error);
+    void flush();
+    void handle_write(boost::system::error_code const& error);
+    void start_read();
+    void handle_read(boost::system::error_code const& error, std::size_t bytes_transferred);
+    void parse_responses();
+    void fail(char const* what, boost::system::error_code const& error);
+    void handle_reconnect(boost::system::error_code const& error);
+
+    int m_id;
+    tcp::endpoint m_backend;
+    tcp::socket m_socket;
+    boost::asio::deadline_timer m_timer;	// Reconnect timer.
+    bool m_connected;
+    bool m_writing;
+    std::deque<proxy_request> m_waiting;	// Not sent yet because the pipeline is full.
+    std::deque<proxy_request> m_in_flight;	// Sent, waiting for the response.
+    std::string m_out;				// Requests to be written once the current write finished.
+    std::string m_writing_buf;			// The data of the async_write in progress.
+    boost::array<char, 8192> m_buffer;
+    std::string m_in;				// Received data that isn't a complete response yet.
+};
+
+void upstream_connection::connect()
+{
+  m_socket.async_connect(m_backend, boost::bind(&upstream_connection::handle_connect, this, boost::asio::placeholders::error));
+}
+
+void upstream_connection::handle_connect(boost::system::error_code const& error)
+{
+  if (error)
+  {
+    fail("connect", error);
+    return;
+  }
+  m_socket.set_option(tcp::no_delay(true));
+  m_connected = true;
+  if (!options.quiet)
+    std::cout << "Upstream #" << m_id << ": connected to " << m_backend << '.' << std::endl;
+  start_read();
+  flush();
+}
+
+void upstream_connection::send(proxy_request& request)
+{
+  m_waiting.push_back(proxy_request());
+  proxy_request& r(m_waiting.back());
+  r.client.swap(request.client);
+  r.reply = request.reply;
+  r.data.swap(request.data);
+  ++stats.upstream_waiting;
+  flush();
+}
+
+// Move as many waiting requests into the pipeline as the pipeline depth allows, and write them.
+void upstream_connection::flush()
+{
+  if (!m_connected)
+    return;
+  while (!m_waiting.empty() && m_in_flight.size() < (std::size_t)options.upstream_depth)
+  {
+    m_out.append(m_waiting.front().data);
+    m_in_flight.push_back(proxy_request());
+    m_in_flight.back().client.swap(m_waiting.front().client);
+    m_in_flight.back().reply = m_waiting.front().reply;
+    m_waiting.pop_front();
+    --stats.upstream_waiting;
+    ++stats.upstream_in_flight;
+  }
+  if (!m_writing && !m_out.empty())
+  {
+    m_writing = true;
+    m_writing_buf.swap(m_out);
+    m_out.clear();
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_writing_buf),
+	boost::bind(&upstream_connection::handle_write, this, boost::asio::placeholders::error));
+  }
+}
+
+void upstream_connection::handle_write(boost::system::error_code const& error)
+{
+  m_writing = false;
+  if (error)
+  {
+    if (error != boost::asio::error::operation_aborted)
+      fail("write", error);
+    return;
+  }
+  flush();
+}
+
+void upstream_connection::start_read()
+{
+  m_socket.async_read_some(boost::asio::buffer(m_buffer),
+      boost::bind(&upstream_connection::handle_read, this,
+	boost::asio::placeholders::error,
+	boost::asio::placeholders::bytes_transferred));
+}
+
+void upstream_connection::handle_read(boost::system::error_code const& error, std::size_t bytes_transferred)
+{
+  if (error)
+  {
+    if (error != boost::asio::error::operation_aborted)
+      fail("read", error);
+    return;
+  }
+  m_in.append(m_buffer.data(), bytes_transferred);
+  parse_responses();
+  start_read();
+}
+
+// Pass every complete response in m_in to the client connection that the request came from.
+void upstream_connection::parse_responses()
+{
+  for (;;)
+  {
+    std::size_t head_end = m_in.find("\r\n\r\n");
+    if (head_end == std::string::npos)
+      return;
+    // Copy the status line and headers, except X-Connection, X-Reply and the hop-by-hop Keep-Alive and Connection
+    // headers, which are replaced by the proxy's.
+    std::string head;
+    unsigned long long content_length = 0;
+    bool chunked = false;
+    for (std::size_t pos = 0; pos < head_end + 2;)
+    {
+      std::size_t eol = m_in.find("\r\n", pos);
+      char const* line = m_in.data() + pos;
+      if (strncasecmp(line, "Content-Length:", 15) == 0)
+	content_length = strtoull(line + 15, NULL, 10);
+      else if (strncasecmp(line, "Transfer-Encoding: chunked", 26) == 0)
+	chunked = true;
+      if (strncasecmp(line, "X-Connection:", 13) != 0 && strncasecmp(line, "X-Reply:", 8) != 0 &&
+	  strncasecmp(line, "Keep-Alive:", 11) != 0 && strncasecmp(line, "Connection:", 11) != 0)
+	head.append(line, eol + 2 - pos);
+      pos = eol + 2;
+    }
+    std::size_t body_begin = head_end + 4;
+    if (chunked)
+    {
+      // Find the end of the last chunk; the chunks are forwarded as-is.
+      std::size_t pos = body_begin;
+      for (;;)
+      {
+	std::size_t eol = m_in.find("\r\n", pos);
+	if (eol == std::string::npos)
+	  return;
+	unsigned long long len = strtoull(m_in.data() + pos, NULL, 16);
+	pos = eol + 2 + len + 2;
+	if (len == 0)
+	  break;
+      }
+      if (m_in.size() < pos)
+	return;
+      content_length = pos - body_begin;
+    }
+    if (m_in.size() < body_begin + content_length)
+      return;
+    if (m_in_flight.empty())
+    {
+      fail("unexpected response", boost::system::error_code());
+      return;
+    }
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "X-Upstream: %d\r\n", m_id);
+    head.append(buf);
+    std::string body(m_in, body_begin, content_length);
+    m_in.erase(0, body_begin + content_length);
+    proxy_request& r(m_in_flight.front());
+    if (boost::shared_ptr<tcp_connection> client = r.client.lock())
+      client->complete_reply(r.reply, head, body);
+    m_in_flight.pop_front();
+    --stats.upstream_in_flight;
+  }
+  flush();
+}
+
+// Answer all requests in the pipeline with a 502 and reconnect after a second.
+// The requests that weren't sent yet are sent after reconnecting.
+void upstream_connection::fail(char const* what, boost::system::error_code const& error)
+{
+  std::cout << "Upstream #" << m_id << ": " << what << " error " << error << '.' << std::endl;
+  char head[160];
+  char const* body = "<html><body>Bad Gateway</body></html>\n";
+  std::snprintf(head, sizeof head, "HTTP/1.1 502 Bad Gateway\r\nContent-Length: %zu\r\nContent-Type: text/html\r\nX-Upstream: %d\r\n", std::strlen(body), m_id);
+  for (std::deque<proxy_request>::iterator r = m_in_flight.begin(); r != m_in_flight.end(); ++r)
+  {
+    if (boost::shared_ptr<tcp_connection> client = r->client.lock())
+      client->complete_reply(r->reply, head, body);
+    ++stats.upstream_errors;
+  }
+  stats.upstream_in_flight -= m_in_flight.size();
+  m_in_flight.clear();
+  m_in.clear();
+  m_out.clear();
+  m_connected = false;
+  boost::system::error_code ec;
+  m_socket.close(ec);
+  m_timer.expires_from_now(boost::posix_time::seconds(1));
+  m_timer.async_wait(boost::bind(&upstream_connection::handle_reconnect, this, boost::asio::placeholders::error));
+}
+
+void upstream_connection::handle_reconnect(boost::system::error_code const& error)
+{
+  if (!error && !m_writing)
+    connect();
+  else if (!error)
+  {
+    // Wait until the aborted write is finished with m_writing_buf.
+    m_timer.expires_from_now(boost::posix_time::millisec(10));
+    m_timer.async_wait(boost::bind(&upstream_connection::handle_reconnect, this, boost::asio::placeholders::error));
+  }
+}
+
+// Proxy mode: the pool of upstream connections, and the head-of-line isolation policy
+// that determines which connection a request is sent over:
+//
+// shared:       round robin; requests of all clients share every upstream pipeline,
+//               so a slow request delays the requests of other clients too.
+// pinned:       every client connection always uses the same upstream connection.
+// least-loaded: the upstream connection with the fewest unanswered requests.
+class upstream_pool
+{
+  public:
+    upstream_pool(boost::asio::io_service& io_service, tcp::endpoint const& backend) : m_next(0)
+    {
+      for (int i = 1; i <= options.upstream_pool; ++i)
+	m_upstreams.push_back(boost::shared_ptr<upstream_connection>(new upstream_connection(io_service, i, backend)));
+    }
+
+    void dispatch(proxy_request& request, int client_instance)
+    {
+      std::size_t n = 0;
+      switch (options.hol_policy)
+      {
+	case server_options::hol_shared:
+	  n = m_next++ % m_upstreams.size();
+	  break;
+	case server_options::hol_pinned:
+	  n = client_instance % m_upstreams.size();
+	  break;
+	case server_options::hol_least_loaded:
+	  for (std::size_t i = 1; i < m_upstreams.size(); ++i)
+	    if (m_upstreams[i]->load() < m_upstreams[n]->load())
+	      n = i;
+	  break;
+      }
+      m_upstreams[n]->send(request);
+    }
+
+  private:
+    std::vector<boost::shared_ptr<upstream_connection> > m_upstreams;
+    std::size_t m_next;
+};
+
+void tcp_connection::forward_request()
+{
+  m_raw_request.append(m_raw_begin, m_raw_end);
+  m_raw_begin = m_raw_end;
+  ++stats.requests;
+  m_reply_queue.push_back(Reply(GET_IO_SERVICE(m_socket), shared_from_this(), "", 0));
+  ++stats.queued_replies;
+  m_reply_queue.back().set_pending(++m_reply);
+  m_reply_queue.back().identify(m_reply, m_controls.request, 0);
+  proxy_request request;
+  request.client = shared_from_this();
+  request.reply = m_reply;
+  request.data.swap(m_raw_request);
+  proxy->dispatch(request, m_instance);
+  m_controls.reset();
+}
+
+// The reply slot passed to a plugin.
+struct http_server_reply
+{
+  boost::weak_ptr<tcp_connection> connection;
+  int reply;
+};
+
+// The thread that runs io_service.run(), and the io_service (set while plugins are loaded).
+pthread_t io_thread;
+boost::asio::io_service* plugin_io_service;
+
+void deliver_plugin_reply(http_server_reply* slot, std::string const& head, std::string const& body)
+{
+  if (boost::shared_ptr<tcp_connection> connection = slot->connection.lock())
+    connection->complete_reply(slot->reply, head, body);
+  delete slot;
+}
+
+extern "C" void plugin_complete(http_server_reply* slot, char const* head, size_t head_len, char const* body, size_t body_len)
+{
+  std::string head_str(head, head_len);
+  std::string body_str(body, body_len);
+  if (pthread_equal(pthread_self(), io_thread))
+    deliver_plugin_reply(slot, head_str, body_str);
+  else
+    plugin_io_service->post(boost::bind(&deliver_plugin_reply, slot, head_str, body_str));
+}
+
+void tcp_connection::call_plugin()
+{
+  plugin_route const* route = m_controls.plugin;
+  ++stats.requests;
+  ++stats.plugin_calls;
+  m_reply_queue.push_back(Reply(GET_IO_SERVICE(m_socket), shared_from_this(), "", 0));
+  ++stats.queued_replies;
+  Reply& r = m_reply_queue.back();
+  r.set_pending(++m_reply);
+  r.identify(m_reply, m_controls.request, m_controls.sleep);
+  r.set_sleeping(m_controls.sleep);
+  http_server_request request;
+  request.connection = m_instance;
+  request.reply = m_reply;
+  request.request = m_controls.request;
+  request.value = m_controls.plugin_value;
+  char const* target_end;
+  m_request_line.target(request.target, target_end);
+  request.target_len = target_end - request.target;
+  http_server_reply* slot = new http_server_reply;
+  slot->connection = shared_from_this();
+  slot->reply = m_reply;
+  m_controls.reset();
+  if (route->handler(route->user_data, &request, slot) != 0)
+  {
+    char const* body = "<html><body>Internal Server Error</body></html>\n";
+    char head[128];
+    std::snprintf(head, sizeof head, "HTTP/1.1 500 Internal Server Error\r\nContent-Length: %zu\r\nContent-Type: text/html\r\n", std::strlen(body));
+    deliver_plugin_reply(slot, head, body);
+  }
+  else
+    process_replies();
+}
+
+// Claims are only accepted while the plugins are initialized.
+bool plugins_initializing;
+
+int claim(name_trie& trie, char const* name, http_server_handler handler, void* user_data)
+{
+  if (!plugins_initializing || !handler || !*name || trie.find(name, name + std::strlen(name)) != name_trie::no_match)
+    return -1;
+  for (char const* p = name; *p; ++p)
+    if (*p & 0x80)
+      return -1;
+  plugin_route route = { handler, user_data };
+  trie.insert(name, number_of_controls + plugin_routes.size());
+  plugin_routes.push_back(route);
+  return 0;
+}
+
+extern "C" int plugin_claim_header(char const* name, http_server_handler handler, void* user_data)
+{
+  return claim(header_controls, name, handler, user_data);
+}
+
+extern "C" int plugin_claim_path(char const* key, http_server_handler handler, void* user_data)
+{
+  return claim(path_controls, key, handler, user_data);
+}
+
+http_server_host const plugin_host = { HTTP_SERVER_PLUGIN_ABI_VERSION, plugin_claim_header, plugin_claim_path, plugin_complete };
+
+// Load the plugin at path, which must be called after init_controls(). Throws on failure.
+void load_plugin(char const* path)
+{
+  void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+    throw std::runtime_error(dlerror());
+  http_server_plugin_init_type init = (http_server_plugin_init_type)dlsym(handle, HTTP_SERVER_PLUGIN_INIT);
+  if (!init)
+    throw std::runtime_error(std::string(path) + ": no " HTTP_SERVER_PLUGIN_INIT);
+  std::size_t routes = plugin_routes.size();
+  plugins_initializing = true;
+  int result = init(&plugin_host);
+  plugins_initializing = false;
+  if (result != 0)
+    throw std::runtime_error(std::string(path) + ": " HTTP_SERVER_PLUGIN_INIT " failed");
+  std::cout << "Loaded plugin " << path << " (" << plugin_routes.size() - routes << " routes)." << std::endl;
+}
+
+class tcp_server
+{
+  public:
+    tcp_server(boost::asio::io_service& io_service) : m_acceptor(io_service), m_count(0)
+    {
+      tcp::endpoint endpoint(tcp::v4(), options.port);
+      m_acceptor.open(endpoint.protocol());
+      m_acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+      if (options.fastopen)
+	set_fastopen();
+      m_acceptor.bind(endpoint);
+      m_acceptor.listen();
+      std::cout << "Listening on port " << options.port << "..." << std::endl;
+      start_accept();
+    }
+
+    // Continue accepting on listener, that was taken over from another process.
+    tcp_server(boost::asio::io_service& io_service, int listener, int next_instance) : m_acceptor(io_service, tcp::v4(), listener), m_count(next_instance - 1)
+    {
+      std::cout << "Took over the listening socket; the next connection is #" << next_instance << '.' << std::endl;
       start_accept();
     }
 
+    // Stop accepting. Returns the listening socket, which must be closed by the caller,
+    // and the number of the next connection in next_instance.
+    int release_listener(int& next_instance)
+    {
+      int listener = dup(m_acceptor.native_handle());
+      m_acceptor.close();
+      // The connection that was waiting for an accept was never used, but skip its number anyway.
+      next_instance = m_count + 1;
+      return listener;
+    }
+
   private:
+    void set_fastopen()
+    {
+      m_acceptor.set_option(tcp_fastopen(options.fastopen));
+      std::cout << "TCP Fast Open enabled with a queue length of " << options.fastopen << '.' << std::endl;
+      // Bit 1 of net.ipv4.tcp_fastopen enables the server side.
+      int sysctl = 0;
+      FILE* f = std::fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+      if (f)
+      {
+	if (std::fscanf(f, "%d", &sysctl) != 1)
+	  sysctl = 0;
+	std::fclose(f);
+      }
+      if (!(sysctl & 2))
+	std::cout << "WARNING: net.ipv4.tcp_fastopen = " << sysctl << "; set it to 3 to allow TFO on the server side." << std::endl;
+    }
+
     void start_accept()
     {
       tcp_connection::pointer new_connection = tcp_connection::create(GET_IO_SERVICE(m_acceptor), ++m_count);
@@ -413,6 +2414,8 @@ class tcp_server
 
     void handle_accept(tcp_connection::pointer new_connection, boost::system::error_code const& error)
     {
+      if (!m_acceptor.is_open())	// Handed over to a new process.
+	return;
       if (!error)
       {
 	new_connection->start();
@@ -424,12 +2427,1988 @@ class tcp_server
     int m_count;
 };
 
-int main()
+// The messages that are exchanged over the --control socket. Apart from takeover_request,
+// each message carries a file descriptor.
+struct handoff_message
 {
-  try
+  enum type_t { takeover_request, listener, connection, done };
+
+  int type;
+  int flags;		// takeover_request: handoff_idle_connections.
+  int instance;		// listener: the next connection number to use; connection: its number.
+  int reply;		// connection: the number of replies that were sent over it.
+
+  static int const handoff_idle_connections = 1;
+};
+
+bool send_handoff_message(int sock, handoff_message const& msg, int fd)
+{
+  struct iovec iov = { const_cast<handoff_message*>(&msg), sizeof msg };
+  union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } control;
+  struct msghdr mh;
+  std::memset(&mh, 0, sizeof mh);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd != -1)
   {
-    boost::asio::io_service io_service;
-    tcp_server server(io_service);
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof control.buf;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &mh, MSG_NOSIGNAL) == sizeof msg;
+}
+
+// Receive a message and the file descriptor that comes with it (or -1) in fd.
+// Returns false on error or when the peer closed the socket.
+bool receive_handoff_message(int sock, handoff_message& msg, int& fd)
+{
+  struct iovec iov = { &msg, sizeof msg };
+  union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } control;
+  struct msghdr mh;
+  std::memset(&mh, 0, sizeof mh);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof control.buf;
+  fd = -1;
+  if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != sizeof msg)
+    return false;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return true;
+}
+
+// Hot restart over a unix socket.
+//
+// The new process connects to the --control socket of the running (old) process and sends a
+// takeover_request. The old process replies with the listening socket and the next connection
+// number, stops accepting and drains all its connections. Every connection that becomes idle
+// is then either passed to the new process (with --handoff-idle) or closed. When the last
+// connection is gone the old process sends 'done' and exits.
+class hot_restart
+{
+  public:
+    hot_restart(boost::asio::io_service& io_service) : m_io_service(io_service), m_listen(io_service), m_peer(io_service), m_server(NULL), m_handing_over(false) { }
+    // Connections can still be destroyed after this (along with the io_service).
+    ~hot_restart() { restarter = NULL; }
+
+    // Connect to the running server and receive its listening socket. Returns the listening
+    // socket, or -1 when there is no server to take over from.
+    int takeover(int& next_instance);
+    // Start listening on options.control for a successor.
+    void listen(tcp_server* server);
+    // Called by a draining connection once it is idle.
+    void handoff(tcp_connection* connection);
+    // Called by the destructor of a (started) connection.
+    void connection_destroyed();
+
+  private:
+    void handle_successor(boost::system::error_code const& error);
+    void handle_takeover_request(boost::system::error_code const& error);
+    void handle_predecessor(boost::system::error_code const& error);
+    void finish();
+
+    boost::asio::io_service& m_io_service;
+    boost::asio::posix::stream_descriptor m_listen;	// Our control socket, waiting for a successor.
+    boost::asio::posix::stream_descriptor m_peer;	// Connection with the successor or predecessor.
+    tcp_server* m_server;
+    bool m_handing_over;				// Set when we're the old process.
+    bool m_handoff_idle;				// The successor wants our idle connections.
+};
+
+void tcp_connection::continue_drain()
+{
+  if (m_closed)
+    return;
+  if (m_reading)
+  {
+    // Abort the pending read, unless that would also abort a pending write.
+    if (m_write_queue.empty())
+      m_socket.cancel();
+    return;
+  }
+  if (!m_at_boundary)
+  {
+    // Read the remainder of the current request.
+    start_read();
+    return;
+  }
+  // A connection that is closed after its last reply (lingering_close) is not handed over.
+  if (!m_reply_queue.empty() || !m_write_queue.empty() || m_close_after)
+    return;
+  // Idle, and any unread request is still in the socket's receive buffer.
+  restarter->handoff(this);
+  m_socket.close();
+  m_closed = true;
+}
+
+tcp_connection::~tcp_connection()
+{
+  if (!options.quiet && m_hol_count)
+  {
+    std::cout << prefix();
+    print_hol(std::cout);
+    std::cout << '.' << std::endl;
+  }
+  m_buffer->~receive_buffer();
+  slab_allocator<sizeof(receive_buffer)>::deallocate(m_buffer);
+  --stats.connections;
+  if (live_connections.erase(this) && restarter)
+    restarter->connection_destroyed();
+}
+
+sockaddr_un control_address()
+{
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, options.control, sizeof addr.sun_path - 1);
+  return addr;
+}
+
+int hot_restart::takeover(int& next_instance)
+{
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  sockaddr_un addr = control_address();
+  if (connect(sock, (sockaddr*)&addr, sizeof addr) == -1)
+  {
+    close(sock);
+    return -1;		// Nobody there.
+  }
+  handoff_message msg = { handoff_message::takeover_request, options.handoff_idle ? handoff_message::handoff_idle_connections : 0, 0, 0 };
+  int listener;
+  if (!send_handoff_message(sock, msg, -1) || !receive_handoff_message(sock, msg, listener) ||
+      msg.type != handoff_message::listener || listener == -1)
+    throw std::runtime_error("Hot restart: failed to receive the listening socket.");
+  next_instance = msg.instance;
+  // Keep receiving the idle connections until the old process is done.
+  m_peer.assign(sock);
+  m_peer.async_read_some(boost::asio::null_buffers(), boost::bind(&hot_restart::handle_predecessor, this, boost::asio::placeholders::error));
+  return listener;
+}
+
+void hot_restart::listen(tcp_server* server)
+{
+  m_server = server;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  sockaddr_un addr = control_address();
+  // Replace the socket of a predecessor (or a stale one).
+  unlink(options.control);
+  if (bind(sock, (sockaddr*)&addr, sizeof addr) == -1 || ::listen(sock, 1) == -1)
+    throw std::runtime_error(std::string("Hot restart: cannot listen on ") + options.control + ": " + std::strerror(errno));
+  m_listen.assign(sock);
+  m_listen.async_read_some(boost::asio::null_buffers(), boost::bind(&hot_restart::handle_successor, this, boost::asio::placeholders::error));
+}
+
+void hot_restart::handle_successor(boost::system::error_code const& error)
+{
+  if (error)
+    return;
+  int sock = accept4(m_listen.native_handle(), NULL, NULL, SOCK_CLOEXEC);
+  if (sock == -1)
+  {
+    m_listen.async_read_some(boost::asio::null_buffers(), boost::bind(&hot_restart::handle_successor, this, boost::asio::placeholders::error));
+    return;
+  }
+  // Only one successor; a new server will be listening on our path.
+  m_listen.close();
+  m_peer.assign(sock);
+  m_peer.async_read_some(boost::asio::null_buffers(), boost::bind(&hot_restart::handle_takeover_request, this, boost::asio::placeholders::error));
+}
+
+void hot_restart::handle_takeover_request(boost::system::error_code const& error)
+{
+  handoff_message msg;
+  int fd;
+  if (error || !receive_handoff_message(m_peer.native_handle(), msg, fd) || msg.type != handoff_message::takeover_request)
+  {
+    std::cout << "Hot restart: invalid takeover request; ignored." << std::endl;
+    m_peer.close();
+    return;
+  }
+  m_handing_over = true;
+  m_handoff_idle = msg.flags & handoff_message::handoff_idle_connections;
+  int next_instance;
+  int listener = m_server->release_listener(next_instance);
+  msg.type = handoff_message::listener;
+  msg.instance = next_instance;
+  bool sent = send_handoff_message(m_peer.native_handle(), msg, listener);
+  close(listener);
+  if (!sent)
+    throw std::runtime_error("Hot restart: failed to send the listening socket.");
+  std::cout << "Hot restart: handed over the listening socket; draining " << live_connections.size() << " connections." << std::endl;
+  // Copy the set, because connections can be destroyed while draining.
+  std::vector<tcp_connection::pointer> connections;
+  for (std::set<tcp_connection*>::iterator c = live_connections.begin(); c != live_connections.end(); ++c)
+    connections.push_back((*c)->shared_from_this());
+  for (std::vector<tcp_connection::pointer>::iterator c = connections.begin(); c != connections.end(); ++c)
+    (*c)->drain();
+  connections.clear();
+  connection_destroyed();	// In case there were no connections at all.
+}
+
+void hot_restart::handoff(tcp_connection* connection)
+{
+  if (!m_handoff_idle)
+    return;
+  handoff_message msg = { handoff_message::connection, 0, connection->instance(), connection->reply_count() };
+  if (!send_handoff_message(m_peer.native_handle(), msg, connection->socket().native_handle()))
+    std::cout << "Hot restart: failed to hand over connection #" << connection->instance() << '.' << std::endl;
+}
+
+void hot_restart::connection_destroyed()
+{
+  if (m_handing_over && live_connections.empty())
+    finish();
+}
+
+void hot_restart::finish()
+{
+  m_handing_over = false;
+  handoff_message msg = { handoff_message::done, 0, 0, 0 };
+  send_handoff_message(m_peer.native_handle(), msg, -1);
+  std::cout << "Hot restart: all connections drained; exiting." << std::endl;
+  m_io_service.stop();
+}
+
+void hot_restart::handle_predecessor(boost::system::error_code const& error)
+{
+  handoff_message msg;
+  int fd;
+  if (error || !receive_handoff_message(m_peer.native_handle(), msg, fd) || msg.type == handoff_message::done)
+  {
+    std::cout << "Hot restart: the old server is done." << std::endl;
+    m_peer.close();
+    return;
+  }
+  if (msg.type == handoff_message::connection && fd != -1)
+  {
+    tcp_connection::pointer connection = tcp_connection::create(m_io_service, msg.instance);
+    boost::system::error_code ec;
+    connection->socket().assign(tcp::v4(), fd, ec);
+    if (ec)
+      close(fd);
+    else
+    {
+      connection->set_reply_count(msg.reply);
+      connection->start();
+    }
+  }
+  else if (fd != -1)
+    close(fd);
+  m_peer.async_read_some(boost::asio::null_buffers(), boost::bind(&hot_restart::handle_predecessor, this, boost::asio::placeholders::error));
+}
+
+// Return the resident set size of this process in kB.
+unsigned long resident_set_size()
+{
+  unsigned long size, resident = 0;
+  FILE* statm = std::fopen("/proc/self/statm", "r");
+  if (statm)
+  {
+    if (std::fscanf(statm, "%lu %lu", &size, &resident) != 2)
+      resident = 0;
+    std::fclose(statm);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Return the number of open file descriptors of this process.
+unsigned long open_fds()
+{
+  unsigned long count = 0;
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir)
+  {
+    while (struct dirent* entry = readdir(dir))
+      if (entry->d_name[0] != '.')
+	++count;
+    closedir(dir);
+    --count;		// The descriptor of dir itself.
+  }
+  return count;
+}
+
+// Least squares fit of the last 'window' samples of a resource usage against time;
+// used to detect leaks during long running (soak) tests.
+class growth_tracker
+{
+  public:
+    static int const window = 30;	// Number of intervals that the fit is done over.
+    static int const min_samples = 10;	// Don't warn before having this many samples.
+
+    growth_tracker() : m_next(0), m_size(0) { }
+    void add(double t, double value);
+    // Return the slope of the fit in units per hour, and the coefficient of determination in r2.
+    double slope_per_hour(double& r2) const;
+    bool enough_samples() const { return m_size >= min_samples; }
+
+  private:
+    boost::array<std::pair<double, double>, window> m_samples;
+    int m_next;
+    int m_size;
+};
+
+void growth_tracker::add(double t, double value)
+{
+  m_samples[m_next] = std::make_pair(t, value);
+  m_next = (m_next + 1) % window;
+  if (m_size < window)
+    ++m_size;
+}
+
+double growth_tracker::slope_per_hour(double& r2) const
+{
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+  for (int i = 0; i < m_size; ++i)
+  {
+    double x = m_samples[i].first, y = m_samples[i].second;
+    sx += x; sy += y; sxx += x * x; sxy += x * y; syy += y * y;
+  }
+  double const n = m_size;
+  double vx = n * sxx - sx * sx;
+  double vy = n * syy - sy * sy;
+  double cov = n * sxy - sx * sy;
+  r2 = (vx > 0 && vy > 0) ? cov * cov / (vx * vy) : 0.0;
+  return vx > 0 ? 3600.0 * cov / vx : 0.0;
+}
+
+// Signal handler, run by the event loop thread when the lag monitor finds it stuck.
+extern "C" void print_stuck_backtrace(int)
+{
+  static char const msg[] = "Event loop lag: the event loop thread is stuck in:\n";
+  void* frames[64];
+  int n = backtrace(frames, 64);
+  ssize_t ignored = write(STDERR_FILENO, msg, sizeof msg - 1);
+  (void)ignored;
+  // Skip this handler and the signal trampoline.
+  backtrace_symbols_fd(frames + 2, n - 2, STDERR_FILENO);
+}
+
+// Measures event loop lag: a watchdog thread posts a probe handler every options.lag_interval
+// milliseconds and the probe measures how long it waited to be run.
+class lag_monitor
+{
+  public:
+    lag_monitor(boost::asio::io_service& io_service);
+    ~lag_monitor();
+
+    histogram const& lag() const { return m_lag; }		// Microseconds.
+    std::vector<unsigned long> const& max_per_second() const { return m_max_per_second; }
+    void reset() { m_lag.reset(); m_max_per_second.clear(); }
+
+  private:
+    static void* watchdog_main(void* self) { static_cast<lag_monitor*>(self)->watchdog(); return NULL; }
+    void watchdog();
+    void probe();
+
+    boost::asio::io_service& m_io_service;
+    pthread_t m_thread;
+    std::atomic<bool> m_stop;
+    std::atomic<unsigned long long> m_posted;	// now_ns() when the pending probe was posted, or 0.
+    bool m_reported;				// A backtrace was printed for the pending probe.
+    // Only accessed by the event loop thread.
+    histogram m_lag;
+    std::vector<unsigned long> m_max_per_second;	// The maximum lag in each second since the last reset, in microseconds.
+    unsigned long long m_second;			// The second that m_second_max belongs to.
+    unsigned long m_second_max;
+};
+
+lag_monitor::lag_monitor(boost::asio::io_service& io_service) :
+    m_io_service(io_service), m_stop(false), m_posted(0), m_reported(false), m_second(now_ns() / 1000000000), m_second_max(0)
+{
+  // Call backtrace once, so that it doesn't have to load libgcc in the signal handler.
+  void* frame;
+  backtrace(&frame, 1);
+  struct sigaction action;
+  std::memset(&action, 0, sizeof action);
+  action.sa_handler = print_stuck_backtrace;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &action, NULL);
+  int error = pthread_create(&m_thread, NULL, &lag_monitor::watchdog_main, this);
+  if (error)
+    throw std::runtime_error(std::string("pthread_create: ") + std::strerror(error));
+}
+
+lag_monitor::~lag_monitor()
+{
+  m_stop = true;
+  pthread_join(m_thread, NULL);
+}
+
+void lag_monitor::watchdog()
+{
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!m_stop)
+  {
+    next.tv_nsec += options.lag_interval * 1000000L;
+    next.tv_sec += next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    unsigned long long now = now_ns();
+    unsigned long long posted = m_posted;
+    if (!posted)
+    {
+      m_reported = false;
+      m_posted = now;
+      m_io_service.post(boost::bind(&lag_monitor::probe, this));
+    }
+    else if (!m_reported && now - posted > options.lag_threshold * 1000000ULL)
+    {
+      m_reported = true;
+      pthread_kill(io_thread, SIGUSR2);
+    }
+  }
+}
+
+void lag_monitor::probe()
+{
+  unsigned long long now = now_ns();
+  unsigned long lag = (now - m_posted) / 1000;
+  m_posted = 0;
+  m_lag.add(lag);
+  if (now / 1000000000 != m_second)
+  {
+    m_max_per_second.push_back(m_second_max);
+    m_second = now / 1000000000;
+    m_second_max = 0;
+  }
+  if (lag > m_second_max)
+    m_second_max = lag;
+}
+
+// Non-NULL when --lag-monitor was given.
+lag_monitor* loop_monitor;
+
+// Prints the server statistics every options.interval seconds and warns when
+// the resident set size or number of open file descriptors keeps growing.
+class stats_reporter
+{
+  public:
+    // Report every options.interval seconds using a timer on io_service, or - if io_service is NULL - whenever report() is called.
+    stats_reporter(boost::asio::io_service* io_service) : m_timer(io_service ? new boost::asio::deadline_timer(*io_service) : NULL),
+	m_start(now_ns()), m_last(m_start), m_last_requests(0), m_last_replies(0)
+    {
+      std::fill(m_last_events, m_last_events + perf_counters::max_counters, 0ULL);
+      if (phase_counters)
+	phase_counters->read(m_last_events);
+      start_timer();
+    }
+
+    // Print the statistics of the interval that ended now.
+    void report();
+
+  private:
+    void start_timer()
+    {
+      if (!m_timer)
+	return;
+      m_timer->expires_from_now(boost::posix_time::seconds(options.interval));
+      m_timer->async_wait(boost::bind(&stats_reporter::timed_out, this, boost::asio::placeholders::error));
+    }
+
+    void timed_out(boost::system::error_code const& error)
+    {
+      if (error)
+	return;
+      report();
+      start_timer();
+    }
+
+    void check_growth(char const* what, growth_tracker const& tracker, double threshold, char const* unit);
+
+    boost::scoped_ptr<boost::asio::deadline_timer> m_timer;
+    unsigned long long m_start;
+    unsigned long long m_last;
+    unsigned long m_last_requests;
+    unsigned long m_last_replies;
+    growth_tracker m_rss;
+    growth_tracker m_fds;
+    unsigned long long m_last_events[perf_counters::max_counters];	// The performance counters at the end of the last interval.
+};
+
+void stats_reporter::report()
+{
+  unsigned long long now = now_ns();
+  double elapsed = (now - m_last) * 1e-9;
+  double t = (now - m_start) * 1e-9;
+  unsigned long rss = resident_set_size();
+  unsigned long fds = open_fds();
+  m_rss.add(t, rss);
+  m_fds.add(t, fds);
+  double r2;
+  std::cout << std::fixed << std::setprecision(1) <<
+      "STATS t=" << t << "s: " <<
+      (stats.requests - m_last_requests) / elapsed << " req/s, " <<
+      (stats.replies - m_last_replies) / elapsed << " replies/s; latency us p50 " << stats.latency.percentile(50) <<
+      " p90 " << stats.latency.percentile(90) << " p99 " << stats.latency.percentile(99) << " max " << stats.latency.max() <<
+      "; RSS " << rss << " kB (" << std::showpos << m_rss.slope_per_hour(r2) << " kB/h)" <<
+      ", fds " << std::noshowpos << fds << " (" << std::showpos << m_fds.slope_per_hour(r2) << "/h)" << std::noshowpos <<
+      "; connections " << stats.connections << " (" << stats.closes << " closed on request), queued replies " << stats.queued_replies <<
+      ", armed timers " << stats.armed_timers << ", live Reply objects " << stats.live_replies <<
+      ", write queue " << stats.write_queue_bytes << " bytes";
+  if (stats.route_misses || std::count(stats.route_hits, stats.route_hits + number_of_routes, 0UL) < number_of_routes)
+  {
+    std::cout << "; routes";
+    for (int route = 0; route < number_of_routes; ++route)
+      std::cout << ' ' << route_names[route] << ' ' << stats.route_hits[route];
+    std::cout << " unknown " << stats.route_misses;
+  }
+  if (loop_monitor && loop_monitor->lag().count())
+  {
+    histogram const& lag(loop_monitor->lag());
+    std::cout << "; loop lag us p50 " << lag.percentile(50) << " p99 " << lag.percentile(99) << " max " << lag.max() << " (max per second";
+    for (std::vector<unsigned long>::const_iterator l = loop_monitor->max_per_second().begin(); l != loop_monitor->max_per_second().end(); ++l)
+      std::cout << ' ' << *l;
+    std::cout << ')';
+    loop_monitor->reset();
+  }
+  if (stats.overshoot.count())
+    std::cout << "; timer overshoot ns p50 " << stats.overshoot.percentile(50) << " p99 " << stats.overshoot.percentile(99) <<
+	" max " << stats.overshoot.max();
+  if (!plugin_routes.empty())
+    std::cout << "; plugin calls " << stats.plugin_calls;
+  if (options.proxy)
+    std::cout << "; upstream in flight " << stats.upstream_in_flight << ", waiting " << stats.upstream_waiting <<
+	", 502 replies " << stats.upstream_errors;
+  std::cout << std::endl;
+  if (stats.subscribers || stats.events)
+  {
+    std::cout << "FANOUT t=" << t << "s: " << stats.subscribers << " subscribers; " << stats.events << " events broadcast, " <<
+	stats.deliveries / elapsed << " deliveries/s, " << stats.dropped_events << " dropped; fan-out us per event p50 " << stats.fanout.percentile(50) <<
+	" p99 " << stats.fanout.percentile(99) << " max " << stats.fanout.max() << std::endl;
+    stats.events = 0;
+    stats.deliveries = 0;
+    stats.dropped_events = 0;
+    stats.fanout.reset();
+  }
+  std::cout << "SYSCALLS t=" << t << "s: ";
+  print_syscalls(std::cout, stats.requests - m_last_requests);
+  std::cout << std::endl;
+  syscalls.reset();
+  stats.timer_arms = 0;
+  if (stats.hol_delay.count())
+  {
+    // The connection that suffered the most from HOL blocking since the start.
+    tcp_connection const* worst = NULL;
+    for (std::set<tcp_connection*>::const_iterator c = live_connections.begin(); c != live_connections.end(); ++c)
+      if (!worst || (*c)->hol_total() > worst->hol_total())
+	worst = *c;
+    std::cout << "HOL t=" << t << "s: " << stats.hol_delay.count() << " replies delayed, " <<
+	stats.hol_delay.mean() * stats.hol_delay.count() / 1000 << " ms in total (" << stats.hol_total / 1000 << " ms since the start); delay us p50 " <<
+	stats.hol_delay.percentile(50) << " p90 " << stats.hol_delay.percentile(90) << " p99 " << stats.hol_delay.percentile(99) <<
+	" max " << stats.hol_delay.max() << "; pipeline depth mean " << stats.hol_depth.mean() << " max " << stats.hol_depth.max();
+    if (worst && worst->hol_total())
+    {
+      std::cout << "; worst connection ";
+      worst->print_hol(std::cout);
+    }
+    std::cout << std::endl;
+    stats.hol_delay.reset();
+    stats.hol_depth.reset();
+  }
+  if (phase_scope::enabled)
+  {
+    std::cout << "PHASES t=" << t << "s:" << std::endl;
+    print_phases(stats.requests - m_last_requests);
+    stats.reset_phases();
+    if (phase_counters && stats.requests > m_last_requests)
+    {
+      // Everything that this thread did, including the engine (asio or epoll) between the phases.
+      unsigned long long events[perf_counters::max_counters];
+      phase_counters->read(events);
+      std::cout << std::setw(8) << "thread" << ":";
+      for (int i = 0; i < phase_counters->count(); ++i)
+      {
+	std::cout << (i ? ", " : " ") << (double)(events[i] - m_last_events[i]) / (stats.requests - m_last_requests) << ' ' << phase_counters->name(i);
+	m_last_events[i] = events[i];
+      }
+      std::cout << " per request" << std::endl;
+    }
+  }
+  check_growth("RSS", m_rss, 1024.0, " kB");
+  check_growth("Number of open fds", m_fds, 10.0, "");
+  stats.latency.reset();
+  stats.overshoot.reset();
+  m_last = now;
+  m_last_requests = stats.requests;
+  m_last_replies = stats.replies;
+}
+
+void stats_reporter::check_growth(char const* what, growth_tracker const& tracker, double threshold, char const* unit)
+{
+  double r2;
+  double slope = tracker.slope_per_hour(r2);
+  // Only warn about steady growth: a large slope alone can be caused by a burst of connections.
+  if (tracker.enough_samples() && slope > threshold && r2 > 0.9)
+    std::cout << "WARNING: " << what << " grows by " << std::setprecision(1) << slope << unit <<
+	" per hour (r^2 = " << std::setprecision(2) << r2 << "); possible leak: " <<
+	stats.queued_replies << " queued replies, " << stats.live_replies << " live Reply objects, " <<
+	stats.armed_timers << " armed timers, " << stats.connections << " connections." << std::endl;
+}
+
+// The client side of --bench-socketpair: keeps options.bench_depth requests in the pipeline
+// of a tcp_connection that runs over an AF_UNIX socketpair, until options.bench_requests
+// replies were received.
+class socketpair_bench
+{
+  public:
+    socketpair_bench(boost::asio::io_service& io_service);
+    void report() const;
+
+  private:
+    void send_batch();
+    void handle_write(boost::system::error_code const& error);
+    void start_read();
+    void handle_read(boost::system::error_code const& error, std::size_t bytes_transferred);
+
+    boost::asio::local::stream_protocol::socket m_socket;
+    std::string m_batch;			// options.bench_depth requests.
+    boost::array<char, 65536> m_buffer;
+    std::size_t m_match;			// The number of characters of reply_end that were matched.
+    unsigned long m_sent;
+    unsigned long m_received;
+    unsigned long long m_start;
+    unsigned long long m_end;
+
+    static char const* const reply_end;
+};
+
+// Every reply body ends with this; it does not occur anywhere else in the reply.
+char const* const socketpair_bench::reply_end = "</html>\n";
+
+socketpair_bench::socketpair_bench(boost::asio::io_service& io_service) :
+    m_socket(io_service), m_match(0), m_sent(0), m_received(0), m_end(0)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    throw std::runtime_error(std::string("socketpair: ") + std::strerror(errno));
+  m_socket.assign(boost::asio::local::stream_protocol(), fds[0]);
+  tcp_connection::pointer connection = tcp_connection::create(io_service, 1);
+  connection->socket().assign(tcp::v4(), fds[1]);
+  connection->start();
+  for (int i = 0; i < options.bench_depth; ++i)
+    m_batch += "GET / HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n";
+  std::cout << "Pipelining " << options.bench_requests << " requests, " << options.bench_depth << " at a time, over a socketpair..." << std::endl;
+  phase_scope::enabled = true;
+  m_start = now_ns();
+  syscalls.reset();
+  send_batch();
+  start_read();
+}
+
+void socketpair_bench::send_batch()
+{
+  std::size_t count = std::min<unsigned long>(options.bench_depth, options.bench_requests - m_sent);
+  std::size_t request_size = m_batch.size() / options.bench_depth;
+  m_sent += count;
+  boost::asio::async_write(m_socket, boost::asio::buffer(m_batch.data(), count * request_size),
+      boost::bind(&socketpair_bench::handle_write, this, boost::asio::placeholders::error));
+}
+
+void socketpair_bench::handle_write(boost::system::error_code const& error)
+{
+  if (error)
+    std::cerr << "socketpair_bench: write error " << error << '.' << std::endl;
+}
+
+void socketpair_bench::start_read()
+{
+  m_socket.async_read_some(boost::asio::buffer(m_buffer),
+      boost::bind(&socketpair_bench::handle_read, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void socketpair_bench::handle_read(boost::system::error_code const& error, std::size_t bytes_transferred)
+{
+  if (error)
+  {
+    std::cerr << "socketpair_bench: read error " << error << '.' << std::endl;
+    return;
+  }
+  for (char const* p = m_buffer.data(); p < m_buffer.data() + bytes_transferred; ++p)
+  {
+    // The first character of reply_end does not occur in the rest of it.
+    m_match = *p == reply_end[m_match] ? m_match + 1 : *p == reply_end[0];
+    if (!reply_end[m_match])
+    {
+      m_match = 0;
+      ++m_received;
+    }
+  }
+  if (m_received == options.bench_requests)
+  {
+    m_end = now_ns();
+    phase_scope::enabled = false;
+    m_socket.close();		// The server side sees EOF and is destroyed; then io_service.run() returns.
+    return;
+  }
+  if (m_received == m_sent)
+    send_batch();
+  start_read();
+}
+
+void socketpair_bench::report() const
+{
+  if (!m_end)
+    return;
+  double n = m_received;
+  double total = (m_end - m_start) / n;
+  print_phases(m_received);
+  double server = std::accumulate(stats.phase_ns, stats.phase_ns + number_of_phases, 0ULL) / n;
+  std::cout << std::setw(8) << "server" << ": " << std::setw(8) << server << " ns per request" << std::endl;
+  std::cout << std::setw(8) << "total" << ": " << std::setw(8) << total << " ns per request (" <<
+      std::setprecision(0) << 1e9 / total << " requests/s); the rest is the kernel, asio and the client side." << std::endl;
+  // The client side runs in the same event loop, so its reads and writes are included.
+  print_syscalls(std::cout, m_received);
+  std::cout << " (both sides)" << std::endl;
+}
+
+// --engine epoll: a minimal single threaded server directly on epoll (edge-triggered), a
+// timerfd and non-blocking read and writev, without asio. It uses the same request parsing
+// (parser, header, request_line and request_controls), reply formatting (format_reply) and
+// statistics as tcp_connection, but doesn't support the proxy, plugins, hot restarts or the
+// lag monitor, and never prints the per connection output.
+//
+// Its connections are a basic_connection<Transport, Parser, Timer, Logger>, where each of the
+// four is a policy class: what the connection reads and writes with, how it parses requests,
+// how replies sleep and what is counted and recorded. A feature that a policy leaves out
+// compiles to nothing, instead of being tested for every byte or request. main() runs an
+// epoll_engine for one of the standard instantiations (see --connection).
+
+// A reply in the queue of a basic_connection.
+struct pipelined_reply
+{
+  std::string data;
+  boost::shared_ptr<std::string const> shared;	// Instead of data: an event (or the end of a stream), shared by all subscribers.
+  int number;				// X-Reply, or 0 for an event or the end of a stream.
+  unsigned long request;		// X-Request.
+  unsigned long sleep;			// The requested sleep, in microseconds.
+  unsigned long long received;		// now_ns() at the moment the request was received.
+  unsigned long long ready;		// now_ns() at the moment the reply could be written, or 0 while sleeping.
+  unsigned long long deadline;		// now_ns() at which a sleeping reply wakes up.
+  bool blocked;				// A reply before it was still sleeping when it became ready (head-of-line blocking).
+  unsigned long long events;		// The head of a stream: the number of events to stream (0: no limit); otherwise 0.
+  bool stream;				// The head of a stream (X-Subscribe).
+
+  std::string const& bytes() const { return shared ? *shared : data; }
+};
+
+// Transport policy: a non-blocking socket.
+class socket_transport
+{
+  public:
+    explicit socket_transport(int fd) : m_fd(fd) { }
+    int fd() const { return m_fd; }
+    ssize_t read(char* buf, std::size_t len) { return recv(m_fd, buf, len, 0); }
+    // Like writev, but a client that reset the connection gives EPIPE instead of SIGPIPE.
+    ssize_t write(iovec const* iov, int count)
+    {
+      msghdr msg;
+      std::memset(&msg, 0, sizeof msg);
+      msg.msg_iov = const_cast<iovec*>(iov);
+      msg.msg_iovlen = count;
+      return sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+    }
+    void shutdown_write() { shutdown(m_fd, SHUT_WR); }
+    void close() { ::close(m_fd); }	// Also removes it from the epoll set.
+
+  private:
+    int m_fd;
+};
+
+// Parser policy: everything that tcp_connection parses: the controls in the headers and the
+// request target (X-Sleep, X-Request, X-Size, ...), request bodies (Content-Length) and the
+// last request of a connection (Connection: close, HTTP/1.0).
+class control_parser
+{
+  public:
+    control_parser() : m_eom("\r\n\r\n"), m_body_left(0), m_complete(false), m_last(false) { }
+
+    // Consume [p, end) up to and including the end of the next request and return where it
+    // stopped. If that is the end of a request, complete() is true until next() is called.
+    char const* feed(char const* p, char const* end);
+    bool complete() const { return m_complete; }
+    // The request that completed is the last one of the connection.
+    bool last() const { return m_last; }
+    unsigned long sleep() const { return m_controls.sleep; }
+    unsigned long request() const { return m_controls.request; }
+    // The completed request is a subscription to the broadcast events (X-Subscribe), of events() events.
+    static bool const streams = true;
+    bool stream() const { return m_controls.stream; }
+    unsigned long long events() const { return m_controls.events; }
+    std::string format(char const* connection, int instance, int reply) const
+    {
+      return m_controls.stream ? format_stream_head(m_controls, connection, instance, reply) : format_reply(m_controls, connection, instance, reply);
+    }
+    // The reply to the completed request was queued.
+    void next() { m_controls.reset(); m_line.reset(); m_complete = false; }
+
+  private:
+    parser m_eom;
+    unsigned long long m_body_left;	// The number of request body bytes that still have to be skipped.
+    bool m_complete;
+    bool m_last;
+    header m_header;
+    request_line m_line;
+    request_controls m_controls;
+};
+
+char const* control_parser::feed(char const* p, char const* end)
+{
+  for (; p < end; ++p)
+  {
+    if (m_body_left)
+    {
+      std::size_t skip = std::min<std::size_t>(m_body_left, end - p);
+      m_body_left -= skip;
+      m_complete = !m_body_left;
+      return p + skip;
+    }
+    m_eom.feed(*p);
+    m_header.feed(*p);
+    m_line.feed(*p);
+    if (m_eom)
+    {
+      m_eom.reset();
+      m_header.reset();
+      m_last = m_controls.end_of_headers(m_line);
+      m_body_left = m_controls.content_length;
+      m_controls.content_length = 0;
+      if (!m_body_left)
+      {
+	m_complete = true;
+	return p + 1;
+      }
+    }
+    else if (m_header)
+      m_controls.apply_header(m_header);
+  }
+  return p;
+}
+
+// Parser policy: only find the end of every request ("\r\n\r\n"). Requests can't have a body,
+// controls are ignored and every reply is the plain one.
+class eom_parser
+{
+  public:
+    eom_parser() : m_eom("\r\n\r\n"), m_complete(false) { }
+
+    char const* feed(char const* p, char const* end)
+    {
+      for (; p < end; ++p)
+      {
+	m_eom.feed(*p);
+	if (m_eom)
+	{
+	  m_eom.reset();
+	  m_complete = true;
+	  return p + 1;
+	}
+      }
+      return p;
+    }
+    bool complete() const { return m_complete; }
+    bool last() const { return false; }
+    unsigned long sleep() const { return 0; }
+    unsigned long request() const { return 0; }
+    static bool const streams = false;
+    bool stream() const { return false; }
+    unsigned long long events() const { return 0; }
+    std::string format(char const* connection, int instance, int reply) const { return format_reply(request_controls(), connection, instance, reply); }
+    void next() { m_complete = false; }
+
+  private:
+    parser m_eom;
+    bool m_complete;
+};
+
+// Timer policy: sleeping replies and the end of lingering closes, in a priority queue behind one timerfd.
+class timerfd_timers
+{
+  public:
+    static bool const enabled = true;
+
+    // A sleeping reply, or (reply == 0) the end of a lingering close.
+    struct event
+    {
+      unsigned long long deadline;
+      int instance;
+      int reply;
+      bool operator>(event const& e) const { return deadline > e.deadline; }
+    };
+
+    timerfd_timers() : m_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)), m_armed(0) { }
+    ~timerfd_timers() { close(m_fd); }
+    int fd() const { return m_fd; }
+    void add(unsigned long long deadline, int instance, int reply);
+    // The timerfd fired; call expired() until it returns false, and then rearm().
+    void fired();
+    bool expired(unsigned long long now, event& e);
+    void rearm();
+
+  private:
+    int m_fd;				// Fires at the first deadline in m_events.
+    unsigned long long m_armed;		// The deadline that m_fd is set to, or 0.
+    std::priority_queue<event, std::vector<event>, std::greater<event> > m_events;
+};
+
+void timerfd_timers::add(unsigned long long deadline, int instance, int reply)
+{
+  event e = { deadline, instance, reply };
+  m_events.push(e);
+  if (m_armed && m_armed <= deadline)
+    return;
+  // now_ns() and the timerfd both use CLOCK_MONOTONIC.
+  itimerspec when;
+  when.it_interval.tv_sec = when.it_interval.tv_nsec = 0;
+  when.it_value.tv_sec = deadline / 1000000000ULL;
+  when.it_value.tv_nsec = deadline % 1000000000ULL;
+  timerfd_settime(m_fd, TFD_TIMER_ABSTIME, &when, NULL);
+  m_armed = deadline;
+}
+
+void timerfd_timers::fired()
+{
+  unsigned long long expirations;
+  if (read(m_fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+    return;
+  m_armed = 0;
+}
+
+bool timerfd_timers::expired(unsigned long long now, event& e)
+{
+  if (m_events.empty() || m_events.top().deadline > now)
+    return false;
+  e = m_events.top();
+  m_events.pop();
+  return true;
+}
+
+void timerfd_timers::rearm()
+{
+  if (m_events.empty())
+    return;
+  event next = m_events.top();
+  m_events.pop();
+  add(next.deadline, next.instance, next.reply);
+}
+
+// Timer policy: no timers. Sleeps are ignored, and a connection that is closed after its last
+// reply waits for the client to close it, however long that takes.
+struct no_timers
+{
+  static bool const enabled = false;
+  struct event { unsigned long long deadline; int instance; int reply; };
+  int fd() const { return -1; }
+  void add(unsigned long long, int, int) { }
+  void fired() { }
+  bool expired(unsigned long long, event&) { return false; }
+  void rearm() { }
+};
+
+// Logger policy: nothing is counted or recorded, and no time stamps are taken (the statistics
+// of soak mode stay zero, apart from the resource usage).
+struct null_logger
+{
+  static bool const timestamps = false;
+  struct scope { scope(phase_type) { } };
+  static void opened() { }
+  static void closed(std::size_t, std::size_t) { }
+  static void queued() { }
+  static void armed() { }
+  static void woke(unsigned long long) { }
+  static void released(int, pipelined_reply const&, std::size_t) { }
+  static void written(pipelined_reply const&) { }
+  static void lingering() { }
+  static void subscribed(int) { }
+  static void delivered() { }
+  static void dropped() { }
+};
+
+// Logger policy: the statistics of soak mode and the phases (--perf-counters), like tcp_connection.
+struct stats_logger
+{
+  static bool const timestamps = true;
+  typedef phase_scope scope;
+  static void opened() { ++stats.connections; }
+  static void closed(std::size_t queued, std::size_t sleeping) { stats.queued_replies -= queued; stats.armed_timers -= sleeping; --stats.connections; }
+  static void queued() { ++stats.requests; ++stats.queued_replies; }
+  static void armed() { ++stats.armed_timers; ++stats.timer_arms; }
+  static void woke(unsigned long long overshoot) { stats.overshoot.add(overshoot); --stats.armed_timers; }
+  // Reply r is released for writing, with 'depth' replies queued after it. Returns its HOL delay.
+  static unsigned long released(int, pipelined_reply const& r, std::size_t depth) { return r.blocked ? account_hol_delay(r.ready, depth) : 0; }
+  static void written(pipelined_reply const& r) { ++stats.replies; stats.latency.add((now_ns() - r.received) / 1000); --stats.queued_replies; }
+  static void lingering() { ++stats.closes; }
+  static void subscribed(int delta) { stats.subscribers += delta; }
+  static void delivered() { ++stats.deliveries; }
+  static void dropped() { ++stats.dropped_events; }
+};
+
+// Logger policy: the statistics plus the binary access log (--access-log).
+struct access_logger : stats_logger
+{
+  static void released(int connection, pipelined_reply const& r, std::size_t depth)
+  {
+    unsigned long hol = stats_logger::released(connection, r, depth);
+    log_reply(connection, r.number, r.request, r.data, r.received, r.ready, r.sleep, hol);
+  }
+};
+
+// A pipelining HTTP connection of the epoll engine.
+template<class Transport, class Parser, class Timer, class Logger>
+class basic_connection
+{
+  public:
+    typedef Timer timer_type;
+
+    basic_connection(int fd, int instance) : m_transport(fd), m_instance(instance), m_last_reply(0), m_close_after(0),
+	m_writable(true), m_lingering(false), m_closed(false), m_peer_closed(false), m_broken(false), m_written(0), m_released(0), m_subscriber(-1), m_stream_left(0), m_stream_queued(0), m_event(0)
+	{ Logger::opened(); }
+    ~basic_connection();
+
+    int fd() const { return m_transport.fd(); }
+    int instance() const { return m_instance; }
+    // Read until the socket is empty (edge-triggered), queue the replies and write them. Returns
+    // false when the client closed the connection (or on an error); the caller then deletes it.
+    bool handle_read(char* buffer, std::size_t size, Timer& timers);
+    // EPOLLOUT: the socket can be written again.
+    void writable(Timer& timers) { m_writable = true; flush(timers); }
+    // The sleep of reply number 'reply' ended at 'now'.
+    void wake(int reply, unsigned long long now, Timer& timers);
+    // The client closed its side and all replies were written, or writing failed; the caller then closes it.
+    bool done() const { return m_broken || (m_peer_closed && m_replies.empty()); }
+    // Stop streaming and ignore the rest of the events of the current epoll_wait.
+    void close() { if (m_subscriber != -1) unsubscribe(); m_closed = true; }
+    bool closed() const { return m_closed; }
+
+    // The number of connections that are streaming the broadcast events.
+    static std::size_t subscribers() { return s_subscribers.size(); }
+    // Queue broadcast event 'number' (a chunk) on subscriber i and write it; returns the subscriber.
+    static basic_connection* publish(std::size_t i, boost::shared_ptr<std::string const> const& event, unsigned long number, Timer& timers)
+    {
+      basic_connection* c = s_subscribers[i];
+      c->push_event(event, number, timers);
+      return c;
+    }
+
+    static void* operator new(std::size_t) { return slab_allocator<sizeof(basic_connection)>::allocate(); }
+    static void operator delete(void* ptr) { slab_allocator<sizeof(basic_connection)>::deallocate(ptr); }
+
+  private:
+    void queue_reply(Timer& timers);
+    // Write as many of the ready replies at the front of the queue as the socket takes, with one writev.
+    void flush(Timer& timers);
+    bool last_request_queued() const { return m_close_after && m_last_reply >= m_close_after; }
+    // The head of a stream of 'events' events was written.
+    void subscribe(unsigned long long events);
+    void unsubscribe();
+    void push_event(boost::shared_ptr<std::string const> const& event, unsigned long number, Timer& timers);
+
+    static std::vector<basic_connection*> s_subscribers;
+
+    Transport m_transport;
+    int m_instance;
+    Parser m_parser;
+    int m_last_reply;			// The number of the last queued reply.
+    int m_close_after;			// The X-Reply number of the last reply before closing, or 0.
+    bool m_writable;			// Cleared when writev would block; set again by EPOLLOUT.
+    bool m_lingering;			// The last reply was written; discard what is read until the client closes.
+    bool m_closed;			// close() was called; the engine deletes it after the current batch of events.
+    bool m_peer_closed;			// The client closed its side; close once the queued replies were written.
+    bool m_broken;			// Writing failed (the client reset the connection).
+    std::deque<pipelined_reply> m_replies;	// In request order; the front is being written.
+    std::size_t m_written;		// The number of bytes of m_replies.front() that were already written.
+    std::size_t m_released;		// The number of replies at the front that were (partially) written.
+    int m_subscriber;			// The index of this connection in s_subscribers, or -1.
+    unsigned long long m_stream_left;	// The number of events that are still to be streamed.
+    std::size_t m_stream_queued;	// The number of events in m_replies, before the end of the stream.
+    unsigned long m_event;		// The number of the last event that was pushed.
+};
+
+template<class Transport, class Parser, class Timer, class Logger>
+std::vector<basic_connection<Transport, Parser, Timer, Logger>*> basic_connection<Transport, Parser, Timer, Logger>::s_subscribers;
+
+// The last chunk of a stream.
+boost::shared_ptr<std::string const> const& end_of_stream()
+{
+  static boost::shared_ptr<std::string const> chunk(new std::string("0\r\n\r\n"));
+  return chunk;
+}
+
+// Events that are queued on a subscriber that doesn't read them fast enough are dropped beyond this.
+std::size_t const max_queued_events = 1024;
+
+// The number of subscribers that an event is written to per iteration of the event loop.
+std::size_t const fanout_batch = 256;
+
+template<class Transport, class Parser, class Timer, class Logger>
+basic_connection<Transport, Parser, Timer, Logger>::~basic_connection()
+{
+  if (m_subscriber != -1)
+    unsubscribe();
+  // Events and the end of a stream aren't counted as queued replies.
+  std::size_t queued = 0, sleeping = 0;
+  for (std::deque<pipelined_reply>::iterator r = m_replies.begin(); r != m_replies.end(); ++r)
+    if (r->number)
+    {
+      ++queued;
+      if (!r->ready)
+	++sleeping;
+    }
+  Logger::closed(queued, sleeping);
+  m_transport.close();
+}
+
+template<class Transport, class Parser, class Timer, class Logger>
+bool basic_connection<Transport, Parser, Timer, Logger>::handle_read(char* buffer, std::size_t size, Timer& timers)
+{
+  for (;;)
+  {
+    ssize_t len = m_transport.read(buffer, size);
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    if (len == -1 && errno == EINTR)
+      continue;
+    // The client half-closed the connection after pipelining requests: still send the (sleeping)
+    // replies. Later events (with EPOLLOUT) read EOF again; the caller closes once done().
+    if (len == 0 && (m_peer_closed || (!m_replies.empty() && m_subscriber == -1)))
+    {
+      m_peer_closed = true;
+      return true;
+    }
+    if (len <= 0)
+      return false;
+    if (m_lingering || last_request_queued())
+      continue;		// Discard everything after the last request.
+    typename Logger::scope scope(phase_parse);
+    char const* const end = buffer + len;
+    for (char const* p = buffer; p < end && !last_request_queued();)
+    {
+      p = m_parser.feed(p, end);
+      if (m_parser.complete())
+	queue_reply(timers);
+    }
+    flush(timers);
+  }
+}
+
+template<class Transport, class Parser, class Timer, class Logger>
+void basic_connection<Transport, Parser, Timer, Logger>::queue_reply(Timer& timers)
+{
+  typename Logger::scope scope(phase_queue);
+  Logger::queued();
+  m_replies.push_back(pipelined_reply());
+  pipelined_reply& r(m_replies.back());
+  r.number = ++m_last_reply;
+  if (m_parser.last())
+    m_close_after = r.number;
+  r.request = m_parser.request();
+  r.stream = Parser::streams && m_parser.stream();
+  r.events = r.stream ? m_parser.events() : 0;
+  r.sleep = Timer::enabled ? m_parser.sleep() : 0;
+  r.data = m_parser.format(r.number == m_close_after ? close_header : keep_alive_header, m_instance, r.number);
+  // Without time stamps, ready only has to be non-zero.
+  r.received = (Logger::timestamps || Timer::enabled) ? now_ns() : 1;
+  r.ready = r.received;
+  r.deadline = 0;
+  // Blocked if the reply before it is sleeping, or is itself blocked and wasn't released yet.
+  std::size_t n = m_replies.size();
+  r.blocked = n > 1 && (!m_replies[n - 2].ready || (m_replies[n - 2].blocked && n - 2 >= m_released));
+  if (r.sleep)
+  {
+    r.ready = 0;
+    r.deadline = r.received + 1000ULL * r.sleep;
+    timers.add(r.deadline, m_instance, r.number);
+    Logger::armed();
+  }
+  m_parser.next();
+}
+
+template<class Transport, class Parser, class Timer, class Logger>
+void basic_connection<Transport, Parser, Timer, Logger>::flush(Timer& timers)
+{
+  typename Logger::scope scope(phase_write);
+  while (m_writable && !m_replies.empty() && m_replies.front().ready)
+  {
+    iovec iov[64];
+    int count = 0;
+    for (std::deque<pipelined_reply>::iterator r = m_replies.begin(); r != m_replies.end() && r->ready && count < 64; ++r)
+    {
+      if (count >= (int)m_released)
+      {
+	if (r->number)
+	  Logger::released(m_instance, *r, m_replies.size() - count - 1);
+	++m_released;
+      }
+      std::string const& bytes(r->bytes());
+      iov[count].iov_base = const_cast<char*>(bytes.data()) + (count ? 0 : m_written);
+      iov[count].iov_len = bytes.size() - (count ? 0 : m_written);
+      ++count;
+      // The replies after the head of a stream wait for the end of the stream.
+      if (r->stream)
+	break;
+    }
+    ssize_t len = m_transport.write(iov, count);
+    if (len == -1)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	m_writable = false;	// Wait for EPOLLOUT.
+      else if (errno != EINTR)
+      {
+	// EPIPE, ECONNRESET: the client went away; the caller closes the connection.
+	m_writable = false;
+	m_broken = true;
+      }
+      return;
+    }
+    std::size_t left = len;
+    while (left && left >= m_replies.front().bytes().size() - m_written)
+    {
+      pipelined_reply const& r(m_replies.front());
+      left -= r.bytes().size() - m_written;
+      if (r.number)
+	Logger::written(r);
+      else if (r.shared != end_of_stream())
+	--m_stream_queued;
+      bool stream = r.stream;
+      unsigned long long events = r.events;
+      m_written = 0;
+      --m_released;
+      m_replies.pop_front();
+      if (stream)
+	subscribe(events);
+      if (m_replies.empty())
+	break;
+    }
+    m_written += left;
+  }
+  if (m_replies.empty() && last_request_queued() && !m_lingering)
+  {
+    // Lingering close, like tcp_connection::lingering_close.
+    Logger::lingering();
+    m_lingering = true;
+    m_transport.shutdown_write();
+    if (Timer::enabled)
+      timers.add(now_ns() + linger_timeout * 1000000000ULL, m_instance, 0);
+  }
+}
+
+template<class Transport, class Parser, class Timer, class Logger>
+void basic_connection<Transport, Parser, Timer, Logger>::wake(int reply, unsigned long long now, Timer& timers)
+{
+  bool blocked = false;
+  for (std::deque<pipelined_reply>::iterator r = m_replies.begin(); r != m_replies.end(); ++r)
+  {
+    if (r->number == reply)
+    {
+      Logger::woke(now - r->deadline);
+      r->ready = now;
+      r->blocked = blocked;
+      break;
+    }
+    blocked = blocked || !r->ready;
+  }
+  flush(timers);
+}
+
+template<class Transport, class Parser, class Timer, class Logger>
+void basic_connection<Transport, Parser, Timer, Logger>::subscribe(unsigned long long events)
+{
+  // The end of the stream; it isn't ready (and blocks the replies after it) until the last event was queued.
+  m_replies.push_front(pipelined_reply());
+  pipelined_reply& end(m_replies.front());
+  end.shared = end_of_stream();
+  for (std::deque<pipelined_reply>::iterator r = m_replies.begin() + 1; r != m_replies.end(); ++r)
+    r->blocked = true;
+  m_stream_left = events ? events : ULLONG_MAX;
+  m_stream_queued = 0;
+  m_subscriber = s_subscribers.size();
+  s_subscribers.push_back(this);
+  Logger::subscribed(1);
+}
+
+template<class Transport, class Parser, class Timer, class Logger>
+void basic_connection<Transport, Parser, Timer, Logger>::unsubscribe()
+{
+  basic_connection* last = s_subscribers.back();
+  s_subscribers[m_subscriber] = last;
+  last->m_subscriber = m_subscriber;
+  s_subscribers.pop_back();
+  m_subscriber = -1;
+  Logger::subscribed(-1);
+}
+
+template<class Transport, class Parser, class Timer, class Logger>
+void basic_connection<Transport, Parser, Timer, Logger>::push_event(boost::shared_ptr<std::string const> const& event, unsigned long number, Timer& timers)
+{
+  // A fan-out can visit a subscriber twice when another one unsubscribes halfway (see epoll_engine::fan_out).
+  if (m_event == number)
+    return;
+  m_event = number;
+  if (m_stream_queued < max_queued_events)
+  {
+    // Insert it before the end of the stream; that is never partially written, so this is never before m_written.
+    pipelined_reply& r(*m_replies.insert(m_replies.begin() + m_stream_queued, pipelined_reply()));
+    r.shared = event;
+    r.ready = 1;
+    ++m_stream_queued;
+    Logger::delivered();
+  }
+  else
+    Logger::dropped();
+  if (--m_stream_left == 0)
+  {
+    m_replies[m_stream_queued].ready = now_ns();
+    unsubscribe();
+  }
+  flush(timers);
+}
+
+// The standard instantiations, selected with --connection (and --access-log).
+typedef basic_connection<socket_transport, control_parser, timerfd_timers, stats_logger> standard_connection;
+typedef basic_connection<socket_transport, control_parser, timerfd_timers, access_logger> logged_connection;
+typedef basic_connection<socket_transport, eom_parser, no_timers, null_logger> minimal_connection;
+
+// The event loop of --engine epoll, for connections of type Connection (a basic_connection).
+template<class Connection>
+class epoll_engine
+{
+  public:
+    epoll_engine(char const* name);
+    ~epoll_engine();
+    void run();
+
+  private:
+    typedef typename Connection::timer_type timer_type;
+
+    void accept_connections();
+    // Closed connections are only deleted after the events of the current epoll_wait were
+    // handled, because later events of the same batch can still point to them.
+    void close_connection(Connection* c);
+    void delete_closed();
+    void expire_timers();
+    // Broadcast the next event to all subscribers (--publish).
+    void publish();
+    // Write the event to the next fanout_batch subscribers.
+    void fan_out();
+
+    int m_epoll_fd;
+    int m_listener;
+    int m_report_fd;			// Fires every options.interval seconds in soak mode.
+    int m_publish_fd;			// Fires every options.publish milliseconds.
+    unsigned long m_event;		// The number of the last broadcast event.
+    boost::shared_ptr<std::string const> m_event_chunk;	// The event that is being broadcast.
+    std::size_t m_fanout;		// The number of subscribers that m_event_chunk still has to be written to.
+    unsigned long long m_fanout_start;	// When the broadcast of m_event_chunk started.
+    int m_count;			// The number of accepted connections.
+    std::map<int, Connection*> m_connections;	// By instance; to find the connection of a timer.
+    std::vector<Connection*> m_closed;	// Closed during the current batch of events.
+    timer_type m_timers;
+    boost::array<char, 65536> m_buffer;	// Shared by all connections: the parser state is per connection.
+};
+
+template<class Connection>
+epoll_engine<Connection>::epoll_engine(char const* name) : m_report_fd(-1), m_publish_fd(-1), m_event(0), m_fanout(0), m_fanout_start(0), m_count(0)
+{
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  m_listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (m_epoll_fd == -1 || m_listener == -1)
+    throw std::runtime_error(std::string("epoll_engine: ") + std::strerror(errno));
+  int one = 1;
+  setsockopt(m_listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (options.fastopen)
+    setsockopt(m_listener, IPPROTO_TCP, TCP_FASTOPEN, &options.fastopen, sizeof options.fastopen);
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(options.port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(m_listener, (sockaddr*)&addr, sizeof addr) == -1 || listen(m_listener, SOMAXCONN) == -1)
+    throw std::runtime_error(std::string("epoll_engine: ") + std::strerror(errno));
+  // The listener is level-triggered; EPOLLEXCLUSIVE wakes only one waiter if several processes share it.
+  epoll_event event;
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.ptr = NULL;
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listener, &event);
+  if (timer_type::enabled)
+  {
+    event.events = EPOLLIN;
+    event.data.ptr = &m_timers;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_timers.fd(), &event);
+  }
+  if (options.soak)
+  {
+    m_report_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec interval;
+    interval.it_interval.tv_sec = interval.it_value.tv_sec = options.interval;
+    interval.it_interval.tv_nsec = interval.it_value.tv_nsec = 0;
+    timerfd_settime(m_report_fd, 0, &interval, NULL);
+    event.events = EPOLLIN;
+    event.data.ptr = &m_report_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_report_fd, &event);
+  }
+  if (options.publish)
+  {
+    m_publish_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec interval;
+    interval.it_interval.tv_sec = interval.it_value.tv_sec = options.publish / 1000;
+    interval.it_interval.tv_nsec = interval.it_value.tv_nsec = options.publish % 1000 * 1000000L;
+    timerfd_settime(m_publish_fd, 0, &interval, NULL);
+    event.events = EPOLLIN;
+    event.data.ptr = &m_publish_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_publish_fd, &event);
+  }
+  std::cout << "Listening on port " << options.port << " (epoll engine, " << name << " connections)..." << std::endl;
+}
+
+template<class Connection>
+epoll_engine<Connection>::~epoll_engine()
+{
+  while (!m_connections.empty())
+    close_connection(m_connections.begin()->second);
+  delete_closed();
+  close(m_listener);
+  if (m_report_fd != -1)
+    close(m_report_fd);
+  if (m_publish_fd != -1)
+    close(m_publish_fd);
+  close(m_epoll_fd);
+}
+
+template<class Connection>
+void epoll_engine<Connection>::run()
+{
+  boost::scoped_ptr<stats_reporter> reporter;
+  if (options.soak)
+    reporter.reset(new stats_reporter(NULL));
+  epoll_event events[256];
+  for (;;)
+  {
+    // Don't block while an event is being broadcast.
+    int n = epoll_wait(m_epoll_fd, events, 256, m_fanout ? 0 : -1);
+    if (n == -1 && errno != EINTR)
+      throw std::runtime_error(std::string("epoll_wait: ") + std::strerror(errno));
+    for (int i = 0; i < n; ++i)
+    {
+      void* ptr = events[i].data.ptr;
+      if (!ptr)
+	accept_connections();
+      else if (ptr == &m_timers)
+	expire_timers();
+      else if (ptr == &m_report_fd)
+      {
+	unsigned long long expirations;
+	if (read(m_report_fd, &expirations, sizeof expirations) > 0)
+	  reporter->report();
+      }
+      else if (ptr == &m_publish_fd)
+      {
+	unsigned long long expirations;
+	if (read(m_publish_fd, &expirations, sizeof expirations) > 0)
+	  publish();
+      }
+      else
+      {
+	Connection* c = static_cast<Connection*>(ptr);
+	if (c->closed())
+	  continue;
+	// Writing doesn't close connections; handle_read does when the client went away.
+	if (events[i].events & EPOLLOUT)
+	  c->writable(m_timers);
+	if (((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !c->handle_read(m_buffer.data(), m_buffer.size(), m_timers)) ||
+	    c->done())
+	  close_connection(c);
+      }
+    }
+    delete_closed();
+    if (m_fanout)
+      fan_out();
+  }
+}
+
+template<class Connection>
+void epoll_engine<Connection>::accept_connections()
+{
+  for (;;)
+  {
+    int fd = accept4(m_listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	std::cerr << "accept4: " << std::strerror(errno) << std::endl;
+      return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    Connection* c = new Connection(fd, ++m_count);
+    m_connections[c->instance()] = c;
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = c;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+template<class Connection>
+void epoll_engine<Connection>::close_connection(Connection* c)
+{
+  m_connections.erase(c->instance());
+  c->close();
+  m_closed.push_back(c);
+}
+
+template<class Connection>
+void epoll_engine<Connection>::delete_closed()
+{
+  for (typename std::vector<Connection*>::iterator c = m_closed.begin(); c != m_closed.end(); ++c)
+    delete *c;
+  m_closed.clear();
+}
+
+template<class Connection>
+void epoll_engine<Connection>::expire_timers()
+{
+  m_timers.fired();
+  unsigned long long now = now_ns();
+  typename timer_type::event e;
+  while (m_timers.expired(now, e))
+  {
+    typename std::map<int, Connection*>::iterator ci = m_connections.find(e.instance);
+    if (ci == m_connections.end())
+      continue;		// The connection was closed.
+    if (!e.reply)
+      close_connection(ci->second);	// The client didn't close the connection after the last reply.
+    else
+    {
+      ci->second->wake(e.reply, now, m_timers);
+      if (ci->second->done())
+	close_connection(ci->second);
+    }
+  }
+  m_timers.rearm();
+}
+
+template<class Connection>
+void epoll_engine<Connection>::publish()
+{
+  // A tick during the broadcast of the previous event is skipped.
+  if (m_fanout)
+    return;
+  // The event is formatted once, as a chunk, and every subscriber queues a reference to it.
+  ++m_event;
+  char buf[64];
+  std::string event(buf, std::snprintf(buf, sizeof buf, "id: %lu\ndata: event %lu ", m_event, m_event));
+  if (event.size() + 2 < options.event_size)
+    event.append(options.event_size - event.size() - 2, '.');
+  event += "\n\n";
+  boost::shared_ptr<std::string> chunk(new std::string(buf, std::snprintf(buf, sizeof buf, "%zx\r\n", event.size())));
+  *chunk += event;
+  *chunk += "\r\n";
+  m_event_chunk = chunk;
+  m_fanout = Connection::subscribers();
+  m_fanout_start = now_ns();
+  ++stats.events;
+  fan_out();
+}
+
+// The subscribers are visited from the last to the first, fanout_batch per iteration of the
+// event loop, so that the other connections aren't blocked until all of them were written.
+// A subscriber that unsubscribes is replaced by the last one: that one already has the event
+// (push_event skips it) or is still to be visited. New subscribers start with the next event.
+template<class Connection>
+void epoll_engine<Connection>::fan_out()
+{
+  for (std::size_t n = 0; n < fanout_batch && m_fanout; ++n)
+    if (--m_fanout < Connection::subscribers())
+    {
+      Connection* c = Connection::publish(m_fanout, m_event_chunk, m_event, m_timers);
+      if (c->done())
+	close_connection(c);	// Unsubscribes it, like the end of its stream.
+    }
+  if (!m_fanout)
+  {
+    stats.fanout.add((now_ns() - m_fanout_start) / 1000);
+    m_event_chunk.reset();
+  }
+}
+
+// Run the epoll engine with connections of type Connection until it fails.
+template<class Connection>
+void run_epoll_engine(char const* name)
+{
+  epoll_engine<Connection> engine(name);
+  engine.run();
+}
+
+void usage(char const* name)
+{
+  std::cerr << "Usage: " << name << " [options]\n"
+      "  -p, --port PORT         The port to listen on (default: 9001).\n"
+      "  -q, --quiet             Don't print what is read and written.\n"
+      "  -s, --soak              Soak mode: implies --quiet and prints statistics periodically.\n"
+      "  -i, --interval SECONDS  The interval between statistics reports (default: 10).\n"
+      "  -c, --control PATH      Take over from the server listening on the unix socket PATH, if any,\n"
+      "                          and listen on PATH for a successor (hot restart).\n"
+      "      --handoff-idle      Also take over the idle keep-alive connections of the old server.\n"
+      "      --fastopen QLEN     Enable TCP Fast Open on the listening socket with the given queue length.\n"
+      "      --proxy HOST:PORT   Act as a reverse proxy for the (pipelining) backend at HOST:PORT.\n"
+      "      --upstream-pool N   The number of upstream connections in proxy mode (default: 4).\n"
+      "      --upstream-depth N  The maximum pipeline length of an upstream connection (default: 8).\n"
+      "      --hol-policy POLICY How requests are distributed over the upstream connections:\n"
+      "                          shared (round robin, default), pinned (per client) or least-loaded.\n"
+      "      --spin-us N         Wake up N microseconds before the deadline of a sleep and spin for the rest.\n"
+      "      --lag-monitor MS    Measure the event loop lag with a probe every MS milliseconds.\n"
+      "      --lag-threshold MS  Print a backtrace when a probe waits longer than MS milliseconds (default: 100).\n"
+      "      --plugin PATH       Load the plugin (shared object) at PATH; can be repeated.\n"
+      "      --bench-socketpair N  Don't listen, but pipeline N requests into a connection over a socketpair\n"
+      "                          and report the time per request spent in each phase.\n"
+      "      --bench-depth N     The pipeline depth of --bench-socketpair (default: 16).\n"
+      "      --perf-counters     Also measure the phases with (hardware) performance counters; the results\n"
+      "                          are printed by --bench-socketpair and in soak mode.\n"
+      "      --engine ENGINE     The connection engine: asio (the default) or epoll (a minimal edge-triggered\n"
+      "                          epoll loop; no proxy, plugins, hot restarts, lag monitor or per connection output).\n"
+      "      --connection TYPE   The connections of the epoll engine: standard (the default) or minimal (no controls,\n"
+      "                          request bodies, sleeps, statistics or access log).\n"
+      "      --access-log PREFIX Record every reply in a binary access log, in the segment files PREFIX.TID.N.\n"
+      "      --access-log-size MB  The size of an access log segment (default: 64).\n"
+      "      --publish MS        Broadcast an event every MS milliseconds to the connections that subscribed\n"
+      "                          (X-Subscribe, /subscribe/N); needs --engine epoll.\n"
+      "      --event-size BYTES  The size of the data of a broadcast event (default: 64).\n"
+      "  -h, --help              Print this help." << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  static struct option const long_options[] = {
+    { "port", required_argument, NULL, 'p' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "soak", no_argument, NULL, 's' },
+    { "interval", required_argument, NULL, 'i' },
+    { "control", required_argument, NULL, 'c' },
+    { "handoff-idle", no_argument, NULL, 'H' },
+    { "fastopen", required_argument, NULL, 'F' },
+    { "proxy", required_argument, NULL, 'P' },
+    { "upstream-pool", required_argument, NULL, 'N' },
+    { "upstream-depth", required_argument, NULL, 'D' },
+    { "hol-policy", required_argument, NULL, 'O' },
+    { "plugin", required_argument, NULL, 'L' },
+    { "bench-socketpair", required_argument, NULL, 'B' },
+    { "bench-depth", required_argument, NULL, 'd' },
+    { "perf-counters", no_argument, NULL, 'E' },
+    { "spin-us", required_argument, NULL, 'U' },
+    { "lag-monitor", required_argument, NULL, 'G' },
+    { "lag-threshold", required_argument, NULL, 'T' },
+    { "engine", required_argument, NULL, 'e' },
+    { "connection", required_argument, NULL, 'C' },
+    { "access-log", required_argument, NULL, 'A' },
+    { "access-log-size", required_argument, NULL, 'Z' },
+    { "publish", required_argument, NULL, 'M' },
+    { "event-size", required_argument, NULL, 'V' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "p:qsi:c:h", long_options, NULL)) != -1)
+    switch (c)
+    {
+      case 'p':
+	options.port = std::atoi(optarg);
+	break;
+      case 'q':
+	options.quiet = true;
+	break;
+      case 's':
+	options.soak = options.quiet = true;
+	break;
+      case 'i':
+	options.interval = std::atoi(optarg);
+	if (options.interval <= 0)
+	{
+	  std::cerr << "Invalid interval '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'c':
+	options.control = optarg;
+	break;
+      case 'H':
+	options.handoff_idle = true;
+	break;
+      case 'F':
+	options.fastopen = std::atoi(optarg);
+	if (options.fastopen <= 0)
+	{
+	  std::cerr << "Invalid TCP Fast Open queue length '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'P':
+	options.proxy = optarg;
+	if (!std::strrchr(optarg, ':'))
+	{
+	  std::cerr << "--proxy expects HOST:PORT." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'N':
+	options.upstream_pool = std::atoi(optarg);
+	if (options.upstream_pool <= 0)
+	{
+	  std::cerr << "Invalid upstream pool size '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'D':
+	options.upstream_depth = std::atoi(optarg);
+	if (options.upstream_depth <= 0)
+	{
+	  std::cerr << "Invalid upstream pipeline depth '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'O':
+	if (std::strcmp(optarg, "shared") == 0)
+	  options.hol_policy = server_options::hol_shared;
+	else if (std::strcmp(optarg, "pinned") == 0)
+	  options.hol_policy = server_options::hol_pinned;
+	else if (std::strcmp(optarg, "least-loaded") == 0)
+	  options.hol_policy = server_options::hol_least_loaded;
+	else
+	{
+	  std::cerr << "Unknown HOL policy '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'L':
+	options.plugins.push_back(optarg);
+	break;
+      case 'B':
+	options.bench_requests = std::strtoul(optarg, NULL, 10);
+	options.quiet = true;
+	if (options.bench_requests == 0)
+	{
+	  std::cerr << "Invalid number of requests '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'E':
+	options.perf_counters = true;
+	break;
+      case 'U':
+	options.spin_us = std::strtoul(optarg, NULL, 10);
+	break;
+      case 'G':
+	options.lag_interval = std::atoi(optarg);
+	if (options.lag_interval <= 0)
+	{
+	  std::cerr << "Invalid lag probe interval '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'T':
+	options.lag_threshold = std::atoi(optarg);
+	if (options.lag_threshold <= 0)
+	{
+	  std::cerr << "Invalid lag threshold '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'e':
+	if (std::strcmp(optarg, "asio") == 0)
+	  options.engine = server_options::engine_asio;
+	else if (std::strcmp(optarg, "epoll") == 0)
+	  options.engine = server_options::engine_epoll;
+	else
+	{
+	  std::cerr << "Unknown engine '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'C':
+	if (std::strcmp(optarg, "standard") == 0)
+	  options.connection = server_options::connection_standard;
+	else if (std::strcmp(optarg, "minimal") == 0)
+	  options.connection = server_options::connection_minimal;
+	else
+	{
+	  std::cerr << "Unknown connection type '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'A':
+	options.access_log = optarg;
+	break;
+      case 'Z':
+      {
+	long megabytes = std::atol(optarg);
+	if (megabytes <= 0)
+	{
+	  std::cerr << "Invalid access log segment size '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	options.access_log_size = (std::size_t)megabytes << 20;
+	break;
+      }
+      case 'M':
+	options.publish = std::atoi(optarg);
+	if (options.publish <= 0)
+	{
+	  std::cerr << "Invalid publish interval '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'V':
+      {
+	long size = std::atol(optarg);
+	if (size <= 0 || size > 1 << 20)
+	{
+	  std::cerr << "Invalid event size '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	options.event_size = size;
+	break;
+      }
+      case 'd':
+	options.bench_depth = std::atoi(optarg);
+	if (options.bench_depth <= 0)
+	{
+	  std::cerr << "Invalid pipeline depth '" << optarg << "'." << std::endl;
+	  return 1;
+	}
+	break;
+      case 'h':
+	usage(argv[0]);
+	return 0;
+      default:
+	usage(argv[0]);
+	return 1;
+    }
+
+  if (options.engine == server_options::engine_epoll &&
+      (options.proxy || options.control || !options.plugins.empty() || options.bench_requests || options.lag_interval))
+  {
+    std::cerr << "--engine epoll can't be combined with --proxy, --control, --plugin, --bench-socketpair or --lag-monitor." << std::endl;
+    return 1;
+  }
+  if (options.connection == server_options::connection_minimal && (options.engine != server_options::engine_epoll || options.access_log))
+  {
+    std::cerr << "--connection minimal needs --engine epoll and can't be combined with --access-log." << std::endl;
+    return 1;
+  }
+  if (options.publish && (options.engine != server_options::engine_epoll || options.connection == server_options::connection_minimal))
+  {
+    std::cerr << "--publish needs --engine epoll with standard connections." << std::endl;
+    return 1;
+  }
+
+  init_controls();
+
+  perf_counters counters;
+  if (options.perf_counters)
+  {
+    if (!counters.open())
+      std::cerr << "Warning: perf_event_open failed (" << std::strerror(errno) << "); measuring time only." << std::endl;
+    else
+    {
+      if (!counters.hardware())
+	std::cerr << "Warning: no access to the hardware performance counters; using software counters." << std::endl;
+      phase_counters = &counters;
+    }
+    phase_scope::enabled = true;
+  }
+
+  if (options.access_log)
+  {
+    // Create the first segment of the main thread now, to report errors before listening.
+    try
+    {
+      access_log::thread_log();
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    std::cout << "Access log: " << options.access_log << "." << syscall(SYS_gettid) << ".0" << std::endl;
+  }
+
+  if (options.engine == server_options::engine_epoll)
+  {
+    options.quiet = true;
+    try
+    {
+      // The standard instantiations of basic_connection.
+      if (options.connection == server_options::connection_minimal)
+	run_epoll_engine<minimal_connection>("minimal");
+      else if (options.access_log)
+	run_epoll_engine<logged_connection>("standard, logged");
+      else
+	run_epoll_engine<standard_connection>("standard");
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << e.what() << std::endl;
+    }
+    return 0;
+  }
+
+  try
+  {
+    boost::asio::io_service io_service;
+    io_thread = pthread_self();
+    plugin_io_service = &io_service;
+    for (std::vector<char const*>::iterator plugin = options.plugins.begin(); plugin != options.plugins.end(); ++plugin)
+      load_plugin(*plugin);
+    if (options.bench_requests)
+    {
+      socketpair_bench bench(io_service);
+      io_service.run();
+      bench.report();
+      return 0;
+    }
+    boost::scoped_ptr<upstream_pool> upstreams;
+    if (options.proxy)
+    {
+      std::string backend(options.proxy);
+      std::size_t colon = backend.rfind(':');
+      tcp::resolver resolver(io_service);
+      tcp::resolver::query query(tcp::v4(), backend.substr(0, colon), backend.substr(colon + 1));
+      tcp::endpoint endpoint = *resolver.resolve(query);
+      std::cout << "Proxying to " << endpoint << " over " << options.upstream_pool << " upstream connections." << std::endl;
+      proxy = new upstream_pool(io_service, endpoint);
+      upstreams.reset(proxy);
+    }
+    boost::scoped_ptr<hot_restart> hot_restarter;
+    boost::scoped_ptr<tcp_server> server_ptr;
+    if (options.control)
+    {
+      restarter = new hot_restart(io_service);
+      hot_restarter.reset(restarter);
+      int next_instance;
+      int listener = restarter->takeover(next_instance);
+      if (listener != -1)
+	server_ptr.reset(new tcp_server(io_service, listener, next_instance));
+    }
+    if (!server_ptr)
+      server_ptr.reset(new tcp_server(io_service));
+    if (restarter)
+      restarter->listen(server_ptr.get());
+    boost::scoped_ptr<lag_monitor> monitor;
+    if (options.lag_interval)
+    {
+      loop_monitor = new lag_monitor(io_service);
+      monitor.reset(loop_monitor);
+    }
+    boost::scoped_ptr<stats_reporter> reporter;
+    if (options.soak)
+      reporter.reset(new stats_reporter(&io_service));
     io_service.run();
   }
   catch (std::exception& e)
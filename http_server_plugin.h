@@ -0,0 +1,70 @@
+// http_server_plugin.h -- The C interface of http_server plugins.
+//
+// A plugin is a shared object, loaded with --plugin PATH, that exports
+// http_server_plugin_init. From that function it claims control headers
+// (like "X-Echo: XXX") and/or request target keys (like /echo/XXX) by
+// passing a handler to the host. A request that contains a claimed header
+// or key is answered by calling that handler (the last one wins if a
+// request contains more than one) instead of generating the normal reply.
+//
+// The handler must fill the reply slot by calling host->complete exactly
+// once, either before it returns (synchronously) or later (asynchronously),
+// from any thread. Replies are still sent in the order of the requests, so
+// a slow asynchronous reply holds back the replies after it. If the handler
+// returns non-zero it must not call complete; the request is then answered
+// with a 500 Internal Server Error.
+
+#ifndef HTTP_SERVER_PLUGIN_H
+#define HTTP_SERVER_PLUGIN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Incremented on every incompatible change of this file.
+#define HTTP_SERVER_PLUGIN_ABI_VERSION 1
+
+// The name of the function that every plugin exports.
+#define HTTP_SERVER_PLUGIN_INIT "http_server_plugin_init"
+
+// The request that a handler is called for.
+struct http_server_request
+{
+  int connection;			// The X-Connection number.
+  int reply;				// The X-Reply number of this reply.
+  unsigned long request;		// The X-Request header, or 0.
+  unsigned long long value;		// The (decimal) value of the claimed header or key, or 0.
+  char const* target;			// The request target; only valid until the handler returns.
+  size_t target_len;
+};
+
+// The reply slot of a request (opaque).
+struct http_server_reply;
+
+typedef int (*http_server_handler)(void* user_data, struct http_server_request const* request, struct http_server_reply* reply);
+
+struct http_server_host
+{
+  int abi_version;			// HTTP_SERVER_PLUGIN_ABI_VERSION of the server.
+
+  // Claim a header name or a request target key. Only valid during http_server_plugin_init.
+  // Return 0 on success and -1 if the name is invalid or already taken.
+  int (*claim_header)(char const* name, http_server_handler handler, void* user_data);
+  int (*claim_path)(char const* key, http_server_handler handler, void* user_data);
+
+  // Fill the reply slot. 'head' is the status line followed by the headers, each terminated
+  // by "\r\n"; the server appends X-Connection, X-Reply and the empty line, then 'body'.
+  void (*complete)(struct http_server_reply* reply, char const* head, size_t head_len, char const* body, size_t body_len);
+};
+
+// Called once, after the options were parsed. Return 0 on success.
+typedef int (*http_server_plugin_init_type)(struct http_server_host const* host);
+int http_server_plugin_init(struct http_server_host const* host);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HTTP_SERVER_PLUGIN_H
@@ -0,0 +1,157 @@
+// Print a wire capture of http_client -w.
+//
+// Every run of events of the same connection, request and direction is
+// printed as a line with the time (in seconds since the start of the
+// capture), the connection ID and the request, followed by the data with
+// the same "    < " (read) and "    > " (written) prefixes as the output
+// of http_server.
+//
+// Compile this as:
+//
+// gcc -std=c11 -O2 -o http_wiredump http_wiredump.c
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include "wire_capture.h"
+
+char const* const reading_prefix = "    < ";
+char const* const writing_prefix = "    > ";
+
+int only_connection = -1;		// -c: only print this connection.
+int summarize = 0;			// -s: print the size of bodies instead of their contents.
+
+// Print len bytes of data, escaping \r, \n and non-printable characters, starting a new line with prefix after every \n.
+void print_data(char const* data, size_t len, char const* prefix)
+{
+  int new_line = 1;
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (new_line)
+    {
+      fputs(prefix, stdout);
+      new_line = 0;
+    }
+    unsigned char ch = data[i];
+    if (ch == '\r')
+      fputs("\\r", stdout);
+    else if (ch == '\n')
+    {
+      fputs("\\n\n", stdout);
+      new_line = 1;
+    }
+    else if (isprint(ch))
+      putchar(ch);
+    else
+      printf("\\x%02x", ch);
+  }
+  if (!new_line)
+    putchar('\n');
+}
+
+void usage(char const* name)
+{
+  fprintf(stderr, "Usage: %s [-c connection] [-s] capture_file\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "c:s")) != -1)
+    switch (c)
+    {
+      case 'c':
+	only_connection = atoi(optarg);
+	break;
+      case 's':
+	summarize = 1;
+	break;
+      default:
+	usage(argv[0]);
+	return 1;
+    }
+  if (optind + 1 != argc)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE* f = fopen(argv[optind], "rb");
+  if (!f)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+  struct wire_capture_header header;
+  if (fread(&header, sizeof header, 1, f) != 1 || memcmp(header.magic, WIRE_CAPTURE_MAGIC, sizeof header.magic) != 0)
+  {
+    fprintf(stderr, "%s: not a wire capture.\n", argv[optind]);
+    return 1;
+  }
+  if (header.version != WIRE_CAPTURE_VERSION)
+  {
+    fprintf(stderr, "%s: wire capture version %u, expected %d.\n", argv[optind], header.version, WIRE_CAPTURE_VERSION);
+    return 1;
+  }
+  time_t start = header.start_sec;
+  char date[64];
+  strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime(&start));
+  printf("Capture of %s.%06lu: %lu events over %u connections",
+      date, (unsigned long)header.start_nsec / 1000, (unsigned long)header.records, header.connections);
+  if (header.dropped)
+    printf(" (%lu events were DROPPED).\n", (unsigned long)header.dropped);
+  else
+    printf(".\n");
+
+  size_t data_size = 0;
+  char* data = NULL;
+  // The connection, request and type of the last printed record.
+  int last_connection = -2, last_request = -2;
+  unsigned int last_type = 0;
+  for (uint64_t n = 0; n < header.records; ++n)
+  {
+    struct wire_record record;
+    if (fread(&record, sizeof record, 1, f) != 1)
+    {
+      fprintf(stderr, "%s: truncated after %lu records.\n", argv[optind], (unsigned long)n);
+      return 1;
+    }
+    size_t padded = WIRE_RECORD_SIZE(record.length) - sizeof record;
+    if (padded > data_size)
+    {
+      data_size = padded;
+      data = realloc(data, data_size);
+    }
+    if (fread(data, 1, padded, f) != padded)
+    {
+      fprintf(stderr, "%s: truncated in record %lu.\n", argv[optind], (unsigned long)n);
+      return 1;
+    }
+    if (only_connection >= 0 && record.connection != only_connection)
+      continue;
+    int incoming = record.type == wire_header_in || record.type == wire_data_in;
+    int is_header = record.type == wire_header_in || record.type == wire_header_out;
+    if (record.connection != last_connection || record.request != last_request || record.type != last_type)
+    {
+      printf("[%4lu.%06lu] #%d request %d: %s %s:\n",
+	  (unsigned long)(record.time_ns / 1000000000), (unsigned long)(record.time_ns % 1000000000 / 1000),
+	  record.connection, record.request, incoming ? "reading" : "writing", is_header ? "header" : "body");
+      last_connection = record.connection;
+      last_request = record.request;
+      last_type = record.type;
+    }
+    char const* prefix = incoming ? reading_prefix : writing_prefix;
+    if (summarize && !is_header)
+      printf("%s<%u bytes of body>\n", prefix, record.length);
+    else
+      print_data(data, record.length, prefix);
+  }
+  free(data);
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,55 @@
+// wire_capture.h -- The file format of the wire capture of http_client -w.
+//
+// The client records every header and data event that libcurl passes to
+// its CURLOPT_DEBUGFUNCTION into a buffer that is allocated (and faulted
+// in) before the run, and writes that buffer to the capture file when it
+// exits. http_wiredump prints the file.
+//
+// The file is a wire_capture_header followed by 'records' records. Every
+// record is a wire_record followed by 'length' bytes of data, padded with
+// zeroes to a multiple of 8 bytes. All numbers are in host byte order.
+
+#ifndef WIRE_CAPTURE_H
+#define WIRE_CAPTURE_H
+
+#include <stdint.h>
+
+// The first eight bytes of a capture file.
+#define WIRE_CAPTURE_MAGIC "HTTPWIRE"
+
+// Incremented on every incompatible change of this file.
+#define WIRE_CAPTURE_VERSION 1
+
+// The type of a record; the same as the curl_infotype that it was recorded from.
+enum wire_type
+{
+  wire_header_in = 1,			// CURLINFO_HEADER_IN: reply headers.
+  wire_header_out = 2,			// CURLINFO_HEADER_OUT: request headers.
+  wire_data_in = 3,			// CURLINFO_DATA_IN: reply body.
+  wire_data_out = 4			// CURLINFO_DATA_OUT: request body.
+};
+
+struct wire_capture_header
+{
+  char magic[8];			// WIRE_CAPTURE_MAGIC (without the terminating zero).
+  uint32_t version;			// WIRE_CAPTURE_VERSION.
+  uint32_t connections;			// The largest connection ID plus one.
+  uint64_t start_sec;			// The wall clock time at which the capture started (time 0).
+  uint64_t start_nsec;
+  uint64_t records;			// The number of records that follow.
+  uint64_t dropped;			// The number of events that didn't fit in the buffer anymore.
+};
+
+struct wire_record
+{
+  uint64_t time_ns;			// Nanoseconds since the start of the capture.
+  int32_t connection;			// The connection ID (the connection number of libcurl), or -1 if unknown.
+  int32_t request;			// The index of the request (#N of the client); negative for the pool probes and -1 if unknown.
+  uint32_t type;			// One of wire_type.
+  uint32_t length;			// The number of bytes of data that follow.
+};
+
+// The size of a record with 'length' bytes of data, including the padding.
+#define WIRE_RECORD_SIZE(length) ((sizeof(struct wire_record) + (length) + 7) & ~(size_t)7)
+
+#endif // WIRE_CAPTURE_H